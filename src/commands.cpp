@@ -19,7 +19,12 @@ static void insert_in_map(std::unordered_map<std::string, std::string> &map, con
 
 const std::vector<Command> commands = {
     {"decode",
-     {{"in", true, ""}, {"out", false, "process/decoded"}},
+     {{"in", true, ""},
+      {"out", false, "process/decoded"},
+      {"minmean", false, "0"},
+      {"maxclip", false, "1"},
+      {"mingrad", false, "0"},
+      {"reject", false, "skip"}},
      run_decode,
      "Decode a video file into FITS files."},
     {"debayer",
@@ -27,7 +32,12 @@ const std::vector<Command> commands = {
      run_debayer,
      "Debayer a series of images into color FITS files."},
     {"rate",
-     {{"in", true, ""}, {"percent", true, ""}, {"out", false, "process/rated"}},
+     {{"in", true, ""},
+      {"percent", true, ""},
+      {"out", false, "process/rated"},
+      {"approx", false, "1"},
+      {"refine", false, "10"},
+      {"metric", false, "laplacian"}},
      run_rate,
      "Rate the clarity of the images and copy the best ones."},
     {"register",
@@ -36,7 +46,23 @@ const std::vector<Command> commands = {
       {"out", false, "process/registered"},
       {"rotation", false, "0"},
       {"highpass", false, "1"},
-      {"scaling", false, "0"}},
+      {"scaling", false, "0"},
+      {"fft", false, "opencv"},
+      {"pyramid", false, "1"},
+      {"tolerance", false, "0.05"},
+      {"roi", false, ""},
+      {"interp", false, "lanczos"},
+      {"minpsr", false, "0"},
+      {"maxshift", false, "0"},
+      {"track", false, "0"},
+      {"trackpsr", false, "6"},
+      {"polar", false, ""},
+      {"rotevery", false, "1"},
+      {"upsample", false, "0"},
+      {"ap", false, "0"},
+      {"apcontrast", false, "0.2"},
+      {"engine", false, "fft"},
+      {"cache", false, ""}},
      run_registration,
      "Regsiter the frames to a given reference frame."},
     {"stack",
@@ -44,7 +70,10 @@ const std::vector<Command> commands = {
       {"out", false, "process/stacked.fits"},
       {"method", false, "sigma"},
       {"sigma", false, "2.5"},
-      {"weighted", false, "0"}},
+      {"weighted", false, "0"},
+      {"local", false, "0"},
+      {"percent", false, "50"},
+      {"memory", false, "0"}},
      run_stack,
      "Stack registered frames into a single image."},
 };
@@ -78,6 +78,7 @@ la_result run_debayer(std::unordered_map<std::string, std::string> &args, Pipeli
             out_file.writeComment("CPLANE1 = 'RED' / Color plane 1");
             out_file.writeComment("CPLANE2 = 'GREEN' / Color plane 2");
             out_file.writeComment("CPLANE3 = 'BLUE' / Color plane 3");
+            out_file.copyKeys(fits_file, {"REJECT"});
         }
     }
 
@@ -1,6 +1,7 @@
 #include <filesystem>
 #include <iostream>
 #include <print>
+#include <string>
 
 #include "decode.hpp"
 #include "result.hpp"
@@ -22,7 +23,20 @@ la_result run_decode(std::unordered_map<std::string, std::string> &args, Pipelin
 
     fs::create_directories(output_dir);
 
-    la_result result = SerFile::decode_to_dir(input_file, output_dir);
+    FrameRejection rejection;
+    rejection.min_mean = std::stod(args["minmean"]);
+    rejection.max_clipped = std::stod(args["maxclip"]);
+    rejection.min_gradient = std::stod(args["mingrad"]);
+
+    std::string reject_mode = args["reject"];
+    if (reject_mode != "skip" && reject_mode != "flag")
+    {
+        std::println(std::cerr, "Error: -reject must be 'skip' or 'flag'.");
+        return la_result::Error;
+    }
+    rejection.flag_only = reject_mode == "flag";
+
+    la_result result = SerFile::decode_to_dir(input_file, output_dir, rejection);
 
     return result;
 }
\ No newline at end of file
@@ -0,0 +1,271 @@
+#include "fft.hpp"
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <tuple>
+
+#ifdef LUNALIGN_USE_FFTW
+#include <fftw3.h>
+#endif
+
+void FFTBackend::forwardBatch(const std::vector<cv::Mat> &src, std::vector<cv::Mat> &spectra) const
+{
+    spectra.resize(src.size());
+    for (size_t i = 0; i < src.size(); ++i)
+    {
+        forward(src[i], spectra[i]);
+    }
+}
+
+void FFTBackend::inverseBatch(std::vector<cv::Mat> &spectra, std::vector<cv::Mat> &dst, cv::Size size,
+                              bool scale) const
+{
+    dst.resize(spectra.size());
+    for (size_t i = 0; i < spectra.size(); ++i)
+    {
+        inverse(spectra[i], dst[i], size, scale);
+    }
+}
+
+// OpenCV has no plans to keep; its real transforms already skip the redundant half internally.
+class OpenCVFFT final : public FFTBackend
+{
+  public:
+    void plan(cv::Size, int) const override
+    {
+    }
+
+    void forward(const cv::Mat &src, cv::Mat &spectrum) const override
+    {
+        cv::dft(src, spectrum, cv::DFT_COMPLEX_OUTPUT);
+    }
+
+    void inverse(cv::Mat &spectrum, cv::Mat &dst, cv::Size, bool scale) const override
+    {
+        cv::idft(spectrum, dst, cv::DFT_REAL_OUTPUT | (scale ? cv::DFT_SCALE : 0));
+    }
+
+    std::string_view name() const override
+    {
+        return "opencv";
+    }
+};
+
+#ifdef LUNALIGN_USE_FFTW
+
+// FFTW r2c/c2r plans, one per (size, batch), created under a lock, looked up per thread without it and executed
+// concurrently through the new-array interface. Spectra use the half-width r2c layout.
+class FFTWBackend final : public FFTBackend
+{
+  public:
+    ~FFTWBackend() override
+    {
+        for (auto &[key, plans] : plans_)
+        {
+            fftwf_destroy_plan(plans.forward);
+            fftwf_destroy_plan(plans.inverse);
+        }
+    }
+
+    void plan(cv::Size size, int batch) const override
+    {
+        plansFor(size, batch);
+    }
+
+    void forward(const cv::Mat &src, cv::Mat &spectrum) const override
+    {
+        const Plans &plans = plansFor(src.size(), 1);
+        cv::Mat in = aligned(src, inputScratch());
+
+        if (!spectrum.isContinuous())
+            spectrum.release();
+        spectrum.create(src.rows, src.cols / 2 + 1, CV_32FC2);
+        fftwf_execute_dft_r2c(plans.forward, in.ptr<float>(), reinterpret_cast<fftwf_complex *>(spectrum.ptr<float>()));
+    }
+
+    void inverse(cv::Mat &spectrum, cv::Mat &dst, cv::Size size, bool scale) const override
+    {
+        const Plans &plans = plansFor(size, 1);
+        cv::Mat in = aligned(spectrum, spectrumScratch());
+
+        if (!dst.isContinuous())
+            dst.release();
+        dst.create(size, CV_32F);
+        fftwf_execute_dft_c2r(plans.inverse, reinterpret_cast<fftwf_complex *>(in.ptr<float>()), dst.ptr<float>());
+        if (scale)
+        {
+            dst *= 1.0 / size.area();
+        }
+    }
+
+    void forwardBatch(const std::vector<cv::Mat> &src, std::vector<cv::Mat> &spectra) const override
+    {
+        spectra.resize(src.size());
+        if (src.empty())
+        {
+            return;
+        }
+
+        cv::Size size = src[0].size();
+        int batch = static_cast<int>(src.size());
+        const Plans &plans = plansFor(size, batch);
+
+        // Tiles are stacked vertically into one contiguous buffer, the spectra are views into one output buffer
+        cv::Mat &in = inputScratch();
+        in.create(size.height * batch, size.width, CV_32F);
+        for (int i = 0; i < batch; ++i)
+        {
+            src[i].copyTo(in.rowRange(i * size.height, (i + 1) * size.height));
+        }
+
+        cv::Mat out(size.height * batch, size.width / 2 + 1, CV_32FC2);
+        fftwf_execute_dft_r2c(plans.forward, in.ptr<float>(), reinterpret_cast<fftwf_complex *>(out.ptr<float>()));
+
+        for (int i = 0; i < batch; ++i)
+        {
+            spectra[i] = out.rowRange(i * size.height, (i + 1) * size.height);
+        }
+    }
+
+    void inverseBatch(std::vector<cv::Mat> &spectra, std::vector<cv::Mat> &dst, cv::Size size,
+                      bool scale) const override
+    {
+        dst.resize(spectra.size());
+        if (spectra.empty())
+        {
+            return;
+        }
+
+        int batch = static_cast<int>(spectra.size());
+        const Plans &plans = plansFor(size, batch);
+
+        cv::Mat &in = spectrumScratch();
+        in.create(size.height * batch, size.width / 2 + 1, CV_32FC2);
+        for (int i = 0; i < batch; ++i)
+        {
+            spectra[i].copyTo(in.rowRange(i * size.height, (i + 1) * size.height));
+        }
+
+        cv::Mat out(size.height * batch, size.width, CV_32F);
+        fftwf_execute_dft_c2r(plans.inverse, reinterpret_cast<fftwf_complex *>(in.ptr<float>()), out.ptr<float>());
+        if (scale)
+        {
+            out *= 1.0 / size.area();
+        }
+
+        for (int i = 0; i < batch; ++i)
+        {
+            dst[i] = out.rowRange(i * size.height, (i + 1) * size.height);
+        }
+    }
+
+    std::string_view name() const override
+    {
+        return "fftw";
+    }
+
+  private:
+    struct Plans
+    {
+        fftwf_plan forward = nullptr;
+        fftwf_plan inverse = nullptr;
+    };
+
+    using PlanKey = std::tuple<int, int, int>;
+
+    static inline std::atomic<uint64_t> nextId_{0};
+
+    const uint64_t id_ = nextId_++; // never reused, unlike the address of a destroyed backend
+    mutable std::mutex mutex_;
+    mutable std::map<PlanKey, Plans> plans_;
+
+    // Every transform looks its plans up here. Each thread keeps its own copy of the plans it has used, so the
+    // lock is only taken the first time a thread meets a size.
+    const Plans &plansFor(cv::Size size, int batch) const
+    {
+        thread_local std::map<std::tuple<uint64_t, int, int, int>, Plans> cache;
+
+        auto key = std::make_tuple(id_, size.width, size.height, batch);
+        if (auto it = cache.find(key); it != cache.end())
+        {
+            return it->second;
+        }
+        return cache.emplace(key, sharedPlans(size, batch)).first->second;
+    }
+
+    // Plans shared by all threads, created under the lock because the FFTW planner is not thread-safe
+    Plans sharedPlans(cv::Size size, int batch) const
+    {
+        std::lock_guard lock(mutex_);
+
+        PlanKey key(size.width, size.height, batch);
+        if (auto it = plans_.find(key); it != plans_.end())
+        {
+            return it->second;
+        }
+
+        // Measuring pays off for the small tiles that are transformed thousands of times; full frames are
+        // estimated so that planning stays quick.
+        int n[2] = {size.height, size.width};
+        int realDist = size.area();
+        int cpxDist = size.height * (size.width / 2 + 1);
+        unsigned flags = static_cast<long long>(realDist) * batch <= (1 << 20) ? FFTW_MEASURE : FFTW_ESTIMATE;
+
+        float *real = fftwf_alloc_real(static_cast<size_t>(realDist) * batch);
+        fftwf_complex *cpx = fftwf_alloc_complex(static_cast<size_t>(cpxDist) * batch);
+
+        Plans plans;
+        plans.forward =
+            fftwf_plan_many_dft_r2c(2, n, batch, real, nullptr, 1, realDist, cpx, nullptr, 1, cpxDist, flags);
+        plans.inverse =
+            fftwf_plan_many_dft_c2r(2, n, batch, cpx, nullptr, 1, cpxDist, real, nullptr, 1, realDist, flags);
+
+        fftwf_free(real);
+        fftwf_free(cpx);
+
+        plans_.emplace(key, plans);
+        return plans;
+    }
+
+    // Per-thread scratch for inputs that are not contiguous or not aligned like the planning buffers
+    static cv::Mat &inputScratch()
+    {
+        thread_local cv::Mat scratch;
+        return scratch;
+    }
+
+    static cv::Mat &spectrumScratch()
+    {
+        thread_local cv::Mat scratch;
+        return scratch;
+    }
+
+    static cv::Mat aligned(const cv::Mat &src, cv::Mat &scratch)
+    {
+        if (src.isContinuous() && fftwf_alignment_of(const_cast<float *>(src.ptr<float>())) == 0)
+        {
+            return src;
+        }
+        src.copyTo(scratch);
+        return scratch;
+    }
+};
+
+#endif
+
+std::unique_ptr<FFTBackend> FFTBackend::create(const std::string &name)
+{
+    if (name == "opencv")
+    {
+        return std::make_unique<OpenCVFFT>();
+    }
+#ifdef LUNALIGN_USE_FFTW
+    if (name == "fftw")
+    {
+        return std::make_unique<FFTWBackend>();
+    }
+#endif
+    return nullptr;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <memory>
+#include <opencv2/core.hpp>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// 2-D transforms of real CV_32F images, planned once per size and reused for every frame.
+///
+/// Spectra are CV_32FC2. Their first cols/2+1 columns always hold the non-redundant half of the spectrum, a backend
+/// may also return the conjugate-symmetric remainder. Only spectra produced by the same backend may be combined;
+/// element-wise operations between them are then independent of the layout.
+class FFTBackend
+{
+  public:
+    virtual ~FFTBackend() = default;
+
+    /// Create plans for a size ahead of time, so worker threads never have to. Unplanned sizes are planned on
+    /// first use.
+    virtual void plan(cv::Size size, int batch = 1) const = 0;
+
+    virtual void forward(const cv::Mat &src, cv::Mat &spectrum) const = 0;
+
+    /// Inverse transform into a real image of the given size, unnormalised unless scale is set.
+    /// The spectrum may be overwritten.
+    virtual void inverse(cv::Mat &spectrum, cv::Mat &dst, cv::Size size, bool scale = false) const = 0;
+
+    /// Forward transforms of several equally sized tiles in one call.
+    virtual void forwardBatch(const std::vector<cv::Mat> &src, std::vector<cv::Mat> &spectra) const;
+
+    /// Inverse transforms of several equally sized spectra in one call. The spectra may be overwritten.
+    virtual void inverseBatch(std::vector<cv::Mat> &spectra, std::vector<cv::Mat> &dst, cv::Size size,
+                              bool scale = false) const;
+
+    virtual std::string_view name() const = 0;
+
+    /// "opencv", or "fftw" when built with LUNALIGN_USE_FFTW. Returns nullptr for unavailable backends.
+    static std::unique_ptr<FFTBackend> create(const std::string &name);
+};
@@ -133,6 +133,104 @@ la_result FitsFile::writeKey(const std::string &key, const std::string &value)
     return la_result::Ok;
 }
 
+std::optional<double> FitsFile::readKeyDouble(const std::string &key)
+{
+    int key_status = 0;
+    double value = 0.0;
+
+    if (fits_read_key(fptr, TDOUBLE, key.c_str(), &value, nullptr, &key_status))
+    {
+        return {};
+    }
+    return value;
+}
+
+la_result FitsFile::writeKey(const std::string &key, double value, const std::string &comment)
+{
+    int key_status = 0;
+
+    if (fits_update_key(fptr, TDOUBLE, key.c_str(), &value, comment.c_str(), &key_status))
+    {
+        std::println("Could not write keyword {}.", key);
+        return la_result::Error;
+    }
+    return la_result::Ok;
+}
+
+la_result FitsFile::copyKeys(FitsFile &src, const std::vector<std::string> &keys)
+{
+    for (const auto &key : keys)
+    {
+        int key_status = 0;
+        char card[FLEN_CARD];
+
+        if (fits_read_card(src, key.c_str(), card, &key_status))
+        {
+            continue;
+        }
+
+        fits_write_record(fptr, card, &key_status);
+        if (key_status)
+        {
+            return check_fits_status(key_status);
+        }
+    }
+    return la_result::Ok;
+}
+
+la_result FitsFile::writeExtension(const std::string &extname, const cv::Mat &mat)
+{
+    int ext_status = 0;
+
+    // Replace an extension left over from an earlier run instead of stacking duplicates
+    if (fits_movnam_hdu(fptr, IMAGE_HDU, const_cast<char *>(extname.c_str()), 0, &ext_status) == 0)
+    {
+        fits_delete_hdu(fptr, nullptr, &ext_status);
+    }
+    ext_status = 0;
+
+    cv::Mat data = mat.isContinuous() ? mat : mat.clone();
+    long ext_naxes[2] = {data.cols, data.rows};
+
+    fits_create_img(fptr, FLOAT_IMG, 2, ext_naxes, &ext_status);
+    fits_write_key(fptr, TSTRING, "EXTNAME", (void *)extname.c_str(), nullptr, &ext_status);
+    fits_write_img(fptr, TFLOAT, 1, (LONGLONG)data.total(), (void *)data.ptr<float>(), &ext_status);
+    fits_movabs_hdu(fptr, 1, nullptr, &ext_status);
+
+    return check_fits_status(ext_status);
+}
+
+cv::Mat FitsFile::readExtension(const std::string &extname)
+{
+    int ext_status = 0;
+
+    if (fits_movnam_hdu(fptr, IMAGE_HDU, const_cast<char *>(extname.c_str()), 0, &ext_status))
+    {
+        return {};
+    }
+
+    int ext_bitpix = 0, ext_naxis = 0;
+    long ext_naxes[2] = {0, 0};
+    fits_get_img_param(fptr, 2, &ext_bitpix, &ext_naxis, ext_naxes, &ext_status);
+
+    cv::Mat mat;
+    if (ext_status == 0 && ext_naxis == 2)
+    {
+        mat.create(ext_naxes[1], ext_naxes[0], CV_32F);
+        fits_read_img(fptr, TFLOAT, 1, (LONGLONG)mat.total(), nullptr, mat.ptr<float>(), nullptr, &ext_status);
+    }
+
+    int move_status = 0;
+    fits_movabs_hdu(fptr, 1, nullptr, &move_status);
+
+    if (ext_status)
+    {
+        fits_report_error(stderr, ext_status);
+        return {};
+    }
+    return mat;
+}
+
 la_result check_fits_status(int status)
 {
     if (status)
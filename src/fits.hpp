@@ -171,6 +171,30 @@ class FitsFile
         return result;
     }
 
+    /// Read a rectangular (optionally strided) subset of the image, bounds are 1-based and inclusive.
+    template <typename T>
+    std::vector<T> readSubset(std::vector<long> fpixel, std::vector<long> lpixel, std::vector<long> inc)
+    {
+        long long nelems = 1;
+        for (size_t i = 0; i < fpixel.size(); ++i)
+        {
+            nelems *= (lpixel[i] - fpixel[i]) / inc[i] + 1;
+        }
+
+        std::vector<T> result(nelems);
+        const auto [datatype, bitpx] = getFitsTypes(result);
+
+        fits_read_subset(fptr, datatype, fpixel.data(), lpixel.data(), inc.data(), NULL, result.data(), NULL, &status);
+
+        if (status)
+        {
+            fits_report_error(stderr, status);
+            return {};
+        }
+
+        return result;
+    }
+
     template <typename T> void writeCvMat(cv::Mat &mat)
     {
         int channels = mat.channels();
@@ -267,6 +291,16 @@ class FitsFile
 
     std::optional<std::string> readKey(const std::string &key);
     la_result writeKey(const std::string &key, const std::string &value);
+
+    std::optional<double> readKeyDouble(const std::string &key);
+    la_result writeKey(const std::string &key, double value, const std::string &comment);
+
+    /// Copy the listed header cards from another file, silently skipping the ones it does not have.
+    la_result copyKeys(FitsFile &src, const std::vector<std::string> &keys);
+
+    /// Named CV_32F image extensions for small per-frame side data. The primary HDU stays current afterwards.
+    la_result writeExtension(const std::string &extname, const cv::Mat &mat);
+    cv::Mat readExtension(const std::string &extname);
 };
 
 la_result check_fits_status(int status);
@@ -1,9 +1,12 @@
 #include "rate.hpp"
 #include "result.hpp"
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <filesystem>
 #include <fitsio.h>
 #include <iostream>
+#include <limits>
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgcodecs.hpp>
@@ -22,6 +25,7 @@ struct ImageRating
 {
     fs::path path;
     float rating;
+    FrameRating metrics;
 
     bool operator<(const ImageRating &other) const
     {
@@ -29,9 +33,52 @@ struct ImageRating
     }
 };
 
-float rate_image(FitsFile &image);
+struct TileAccumulator
+{
+    double lap_sum = 0.0, lap_sq = 0.0;
+    double grad_sq = 0.0;
+    double pix_sum = 0.0, pix_sq = 0.0;
+    double hf_energy = 0.0, total_energy = 0.0;
+    long long count = 0;
+    std::vector<float> contrasts;
+    cv::Mat tile_map;
+};
+
+static constexpr float kHighFrequencyCutoff = 0.25f; // fraction of Nyquist
+
+static float rate_tile(const cv::Mat &padded, cv::Rect inner, TileAccumulator &acc);
+static float laplacian_tile(const cv::Mat &blurred, cv::Rect inner, TileAccumulator &acc);
+static void accumulate_spectrum(const cv::Mat &pixels, double mean, TileAccumulator &acc);
+static FrameRating finish_rating(TileAccumulator &acc);
 float calculate_laplacian(int width, int height, std::vector<uint16_t> &image_data);
 
+static const std::array<std::string_view, kRatingMetricCount> metric_names = {"laplacian", "tenengrad", "normvar",
+                                                                              "hfenergy", "contrast"};
+
+std::optional<RatingMetric> parse_rating_metric(const std::string &name)
+{
+    for (int m = 0; m < kRatingMetricCount; ++m)
+    {
+        if (metric_names[m] == name)
+        {
+            return static_cast<RatingMetric>(m);
+        }
+    }
+    return std::nullopt;
+}
+
+std::string_view rating_metric_name(RatingMetric metric)
+{
+    return metric_names[static_cast<int>(metric)];
+}
+
+const std::vector<std::string> &rating_keywords()
+{
+    static const std::vector<std::string> keywords = {"QLAPVAR",  "QTENGRAD", "QNORMVAR", "QHFENRG",
+                                                      "QLCONT90", "QUALITY",  "QMETRIC",  "QAPPROX"};
+    return keywords;
+}
+
 la_result run_rate(std::unordered_map<std::string, std::string> &args, PipelineContext &ctx)
 {
     fs::path input_dir = args["in"];
@@ -40,9 +87,19 @@ la_result run_rate(std::unordered_map<std::string, std::string> &args, PipelineC
 
     fs::path output_dir = args["out"];
 
+    int sampling = std::max(1, std::stoi(args["approx"]));
+    float refine_percentage = std::stof(args["refine"]);
+
+    auto metric = parse_rating_metric(args["metric"]);
+    if (!metric.has_value())
+    {
+        std::println(std::cerr, "Error: Unknown rating metric '{}'.", args["metric"]);
+        return la_result::Error;
+    }
+
     fs::create_directories(output_dir);
 
-    FrameEvaluation evaluator;
+    FrameEvaluation evaluator(metric.value());
 
     std::vector<fs::path> fits_files;
     for (auto const &dir_entry : std::filesystem::directory_iterator{input_dir})
@@ -60,39 +117,118 @@ la_result run_rate(std::unordered_map<std::string, std::string> &args, PipelineC
     {
         auto fits_file = FitsFile(fits_files[i], FitsFile::Mode::ReadOnly);
 
-        auto rating = evaluator.rate_image(fits_file);
-        if (rating.has_value())
+        if (fits_file.readKeyDouble("REJECT").has_value())
         {
-            images[i] = {fits_files[i], rating.value()};
-            std::println("Evaluated image {}: {}", fits_files[i].string(), rating.value());
+            std::println("Skipping rejected image {}", fits_files[i].string());
+            continue;
         }
-    }
 
-    std::println("Finished evaluating!\nCount: {}", images.size());
-
-    int images_to_save = static_cast<float>(images.size()) * (percentage / 100.0);
-    if (images_to_save == 0)
-    {
-        images_to_save = 1;
+        auto rating = evaluator.rate_metrics(fits_file, sampling);
+        if (rating.has_value())
+        {
+            images[i] = {fits_files[i], (*rating)[evaluator.metric()], rating.value()};
+            std::println("Evaluated image {}: {}", fits_files[i].string(), images[i].rating);
+        }
     }
 
+    // Rejected frames and frames that could not be rated are not part of the set -percent is taken over
     std::erase_if(images, [](const ImageRating &img) { return img.path.empty(); });
 
+    std::println("Finished evaluating!\nCount: {}", images.size());
+
     if (images.empty())
     {
         std::println("No images were successfully rated.");
         return la_result::Error;
     }
 
-    std::println("Copying best rated frames:");
+    int images_to_save = static_cast<float>(images.size()) * (percentage / 100.0);
+    images_to_save = std::clamp(images_to_save, 1, static_cast<int>(images.size()));
 
     std::sort(images.begin(), images.end());
 
+    if (sampling > 1)
+    {
+        // Only the ordering around the keep/discard boundary matters. Frames well above it are kept and frames
+        // well below it are dropped on the approximate score; the band in between is re-rated at full resolution
+        // and ranked on the exact score.
+        int n = static_cast<int>(images.size());
+        int margin = static_cast<int>(std::ceil(n * (refine_percentage / 100.0f)));
+        int cutoff = n - images_to_save; // ascending order: [cutoff, n) are kept
+        int band_begin = std::max(0, cutoff - margin);
+        int band_end = std::min(n, cutoff + margin);
+
+#ifdef LUNALIGN_USE_OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (int i = band_begin; i < band_end; ++i)
+        {
+            auto fits_file = FitsFile(images[i].path, FitsFile::Mode::ReadOnly);
+            auto rating = evaluator.rate_metrics(fits_file);
+            if (rating.has_value())
+            {
+                images[i].rating = (*rating)[evaluator.metric()];
+                images[i].metrics = rating.value();
+            }
+        }
+
+        std::sort(images.begin() + band_begin, images.begin() + band_end);
+
+        std::println("Refined {} of {} frames at full resolution around the cutoff.", band_end - band_begin, n);
+    }
+
+    // best_frame becomes the registration reference, so it has to be the best frame on an exact score. The top
+    // frame is re-rated until it is exact; one that drops is moved to its exact place in the ranking.
+    while (images.back().metrics.sampling > 1)
+    {
+        ImageRating top = std::move(images.back());
+        images.pop_back();
+
+        auto fits_file = FitsFile(top.path, FitsFile::Mode::ReadOnly);
+        auto rating = evaluator.rate_metrics(fits_file);
+        if (!rating.has_value())
+        {
+            std::println(std::cerr, "Error: Could not re-rate '{}' at full resolution.", top.path.string());
+            return la_result::Error;
+        }
+        top.rating = (*rating)[evaluator.metric()];
+        top.metrics = rating.value();
+        images.insert(std::upper_bound(images.begin(), images.end(), top), std::move(top));
+    }
+
+    // Kept frames feed local stacking, so their quality maps must cover every tile even when the score is
+    // approximate. The Laplacian pass alone fills them in.
+    int n_images = static_cast<int>(images.size());
+#ifdef LUNALIGN_USE_OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int i = n_images - images_to_save; i < n_images; ++i)
+    {
+        if (images[i].metrics.sampling <= 1)
+        {
+            continue;
+        }
+        auto fits_file = FitsFile(images[i].path, FitsFile::Mode::ReadOnly);
+        if (auto full = evaluator.rate_laplacian(fits_file); full.has_value())
+        {
+            images[i].metrics.tile_map = full->tile_map;
+        }
+    }
+
+    std::println("Copying best rated frames (metric={}):", rating_metric_name(evaluator.metric()));
+
     for (auto &image : images | std::views::reverse | std::views::take(images_to_save))
     {
         fs::path new_path = output_dir / image.path.filename();
         std::println("{}: {}", image.path.filename().string(), image.rating);
         fs::copy_file(image.path, new_path, fs::copy_options::overwrite_existing);
+
+        auto copy = FitsFile(new_path, FitsFile::Mode::ReadWrite);
+        if (evaluator.write_metrics(copy, image.metrics) != la_result::Ok)
+        {
+            std::println(std::cerr, "Error: Could not store the rating in '{}'.", new_path.string());
+            return la_result::Error;
+        }
     }
 
     auto &best = images.back();
@@ -103,41 +239,300 @@ la_result run_rate(std::unordered_map<std::string, std::string> &args, PipelineC
     return result;
 }
 
+FrameEvaluation::FrameEvaluation(RatingMetric metric) : metric_{metric}
+{
+}
+
 std::optional<float> FrameEvaluation::rate_image(FitsFile &image)
 {
+    // The Laplacian alone needs no Sobel, spectrum or contrast pass
+    auto rating = metric_ == RatingMetric::Laplacian ? rate_laplacian(image) : rate_metrics(image);
+    if (!rating.has_value())
+    {
+        return std::nullopt;
+    }
+    return (*rating)[metric_];
+}
 
+std::optional<FrameRating> FrameEvaluation::rate_metrics(FitsFile &image, int sampling)
+{
     int width = image.naxes[0];
     int height = image.naxes[1];
+    long plane = image.naxis != 3 ? 1 : 2;
 
+    // The exact pass reads the green channel once and walks it tile by tile; the sampled pass reads only the
+    // tiles it visits.
     std::vector<uint16_t> mono_layer;
+    cv::Mat imageMat;
+    if (sampling <= 1)
+    {
+        mono_layer = image.readPix<uint16_t>({1, 1, plane}, width * height);
+        if (mono_layer.empty())
+        {
+            return std::nullopt;
+        }
+        imageMat = cv::Mat(height, width, CV_16UC1, mono_layer.data());
+    }
 
-    if(image.naxis != 3){
-        mono_layer = image.readPix<uint16_t>({1, 1, 1}, width * height);
+    int tiles_x = (width + kRatingTileSize - 1) / kRatingTileSize;
+    int tiles_y = (height + kRatingTileSize - 1) / kRatingTileSize;
+
+    TileAccumulator acc;
+    acc.contrasts.reserve(tiles_x * tiles_y);
+    acc.tile_map = cv::Mat(tiles_y, tiles_x, CV_32F, cv::Scalar(std::numeric_limits<float>::quiet_NaN()));
+
+    for (int ty = 0; ty < tiles_y; ++ty)
+    {
+        for (int tx = 0; tx < tiles_x; ++tx)
+        {
+            // Diagonal stripes spread the sampled tiles evenly over both axes
+            if (sampling > 1 && (tx + ty) % sampling != 0)
+            {
+                continue;
+            }
+
+            cv::Rect tile(tx * kRatingTileSize, ty * kRatingTileSize, kRatingTileSize, kRatingTileSize);
+            tile &= cv::Rect(0, 0, width, height);
+
+            // Process with a margin so the blur and Laplacian see the same neighbourhood as a full-frame pass
+            cv::Rect padded(tile.x - kRatingTileMargin, tile.y - kRatingTileMargin, tile.width + 2 * kRatingTileMargin,
+                            tile.height + 2 * kRatingTileMargin);
+            padded &= cv::Rect(0, 0, width, height);
+
+            cv::Rect inner(tile.x - padded.x, tile.y - padded.y, tile.width, tile.height);
+
+            if (sampling <= 1)
+            {
+                acc.tile_map.at<float>(ty, tx) = rate_tile(imageMat(padded), inner, acc);
+                continue;
+            }
+
+            auto data = image.readSubset<uint16_t>({padded.x + 1, padded.y + 1, plane},
+                                                   {padded.x + padded.width, padded.y + padded.height, plane},
+                                                   {1, 1, 1});
+            if (data.empty())
+            {
+                return std::nullopt;
+            }
+
+            acc.tile_map.at<float>(ty, tx) =
+                rate_tile(cv::Mat(padded.height, padded.width, CV_16UC1, data.data()), inner, acc);
+        }
     }
-    else {
-        mono_layer = image.readPix<uint16_t>({1, 1, 2}, width * height);
+
+    if (acc.count == 0)
+    {
+        return std::nullopt;
     }
 
+    FrameRating rating = finish_rating(acc);
+    rating.sampling = std::max(sampling, 1);
+    return rating;
+}
+
+std::optional<FrameRating> FrameEvaluation::rate_laplacian(FitsFile &image)
+{
+    int width = image.naxes[0];
+    int height = image.naxes[1];
+    long plane = image.naxis != 3 ? 1 : 2;
+
+    std::vector<uint16_t> mono_layer = image.readPix<uint16_t>({1, 1, plane}, width * height);
     if (mono_layer.empty())
     {
         return std::nullopt;
     }
-
     cv::Mat imageMat(height, width, CV_16UC1, mono_layer.data());
 
+    int tiles_x = (width + kRatingTileSize - 1) / kRatingTileSize;
+    int tiles_y = (height + kRatingTileSize - 1) / kRatingTileSize;
+
+    TileAccumulator acc;
+    acc.tile_map = cv::Mat(tiles_y, tiles_x, CV_32F);
+
+    for (int ty = 0; ty < tiles_y; ++ty)
+    {
+        for (int tx = 0; tx < tiles_x; ++tx)
+        {
+            cv::Rect tile(tx * kRatingTileSize, ty * kRatingTileSize, kRatingTileSize, kRatingTileSize);
+            tile &= cv::Rect(0, 0, width, height);
+
+            cv::Rect padded(tile.x - kRatingTileMargin, tile.y - kRatingTileMargin, tile.width + 2 * kRatingTileMargin,
+                            tile.height + 2 * kRatingTileMargin);
+            padded &= cv::Rect(0, 0, width, height);
+            cv::Rect inner(tile.x - padded.x, tile.y - padded.y, tile.width, tile.height);
+
+            cv::Mat blurredMat;
+            cv::GaussianBlur(imageMat(padded), blurredMat, cv::Size(5, 5), 0);
+            acc.tile_map.at<float>(ty, tx) = laplacian_tile(blurredMat, inner, acc);
+            acc.count += inner.area();
+        }
+    }
+
+    if (acc.count == 0)
+    {
+        return std::nullopt;
+    }
+
+    double n = static_cast<double>(acc.count);
+    double lap_mean = acc.lap_sum / n;
+
+    FrameRating rating;
+    rating.metrics.fill(std::numeric_limits<float>::quiet_NaN());
+    rating.metrics[static_cast<int>(RatingMetric::Laplacian)] =
+        static_cast<float>(acc.lap_sq / n - lap_mean * lap_mean);
+    rating.tile_map = acc.tile_map;
+    return rating;
+}
+
+la_result FrameEvaluation::write_metrics(FitsFile &file, const FrameRating &rating) const
+{
+    const auto &keywords = rating_keywords();
+
+    for (int m = 0; m < kRatingMetricCount; ++m)
+    {
+        std::string comment(metric_names[m]);
+        if (file.writeKey(keywords[m], rating.metrics[m], comment) != la_result::Ok)
+        {
+            return la_result::Error;
+        }
+    }
+
+    if (file.writeKey(keywords[kRatingMetricCount], rating[metric_], "ranking score") != la_result::Ok)
+    {
+        return la_result::Error;
+    }
+    if (file.writeKey(keywords[kRatingMetricCount + 1], std::string(rating_metric_name(metric_))) != la_result::Ok)
+    {
+        return la_result::Error;
+    }
+    if (rating.sampling > 1 &&
+        file.writeKey(keywords[kRatingMetricCount + 2], rating.sampling, "approximate, rated on 1/N of the tiles") !=
+            la_result::Ok)
+    {
+        return la_result::Error;
+    }
+    return file.writeExtension(kQualityMapExtension, rating.tile_map);
+}
+
+// Returns the Laplacian variance of the tile itself for the quality map
+static float rate_tile(const cv::Mat &padded, cv::Rect inner, TileAccumulator &acc)
+{
     cv::Mat blurredMat;
     cv::Size kernelSize = cv::Size(5, 5);
     double sigmaX = 0;
 
-    cv::GaussianBlur(imageMat, blurredMat, kernelSize, sigmaX);
+    cv::GaussianBlur(padded, blurredMat, kernelSize, sigmaX);
+
+    float tile_variance = laplacian_tile(blurredMat, inner, acc);
 
+    cv::Mat gx, gy;
+    cv::Sobel(blurredMat, gx, CV_32F, 1, 0);
+    cv::Sobel(blurredMat, gy, CV_32F, 0, 1);
+    acc.grad_sq += gx(inner).dot(gx(inner)) + gy(inner).dot(gy(inner));
+
+    cv::Mat pixels;
+    padded(inner).convertTo(pixels, CV_32F);
+    double n = static_cast<double>(inner.area());
+    double tile_sum = cv::sum(pixels)[0];
+    double tile_sq = pixels.dot(pixels);
+    acc.pix_sum += tile_sum;
+    acc.pix_sq += tile_sq;
+    acc.count += inner.area();
+
+    double mean = tile_sum / n;
+    double variance = std::max(0.0, tile_sq / n - mean * mean);
+    acc.contrasts.push_back(mean > 0.0 ? static_cast<float>(std::sqrt(variance) / mean) : 0.f);
+
+    // Partial tiles at the right and bottom edges are skipped, the spectrum needs the full window
+    if (inner.width == kRatingTileSize && inner.height == kRatingTileSize)
+    {
+        accumulate_spectrum(pixels, mean, acc);
+    }
+
+    return tile_variance;
+}
+
+// Adds the Laplacian sums of the tile to acc and returns its own Laplacian variance
+static float laplacian_tile(const cv::Mat &blurred, cv::Rect inner, TileAccumulator &acc)
+{
     cv::Mat laplacianMat;
-    cv::Laplacian(blurredMat, laplacianMat, CV_32F);
+    cv::Laplacian(blurred, laplacianMat, CV_32F);
+
+    cv::Mat lap = laplacianMat(inner);
+    double lap_sum = cv::sum(lap)[0];
+    double lap_sq = lap.dot(lap);
+    acc.lap_sum += lap_sum;
+    acc.lap_sq += lap_sq;
+
+    double n = static_cast<double>(inner.area());
+    double lap_mean = lap_sum / n;
+    return static_cast<float>(lap_sq / n - lap_mean * lap_mean);
+}
+
+static void accumulate_spectrum(const cv::Mat &pixels, double mean, TileAccumulator &acc)
+{
+    static const cv::Mat window = [] {
+        cv::Mat hann;
+        cv::createHanningWindow(hann, cv::Size(kRatingTileSize, kRatingTileSize), CV_32F);
+        return hann;
+    }();
+
+    cv::Mat centered = (pixels - mean).mul(window);
+    cv::Mat spectrum;
+    cv::dft(centered, spectrum, cv::DFT_COMPLEX_OUTPUT);
+
+    const int n = kRatingTileSize;
+    const float cutoff = kHighFrequencyCutoff * (n / 2);
+    const float cutoff_sq = cutoff * cutoff;
+
+    for (int y = 0; y < n; ++y)
+    {
+        int fy = y <= n / 2 ? y : y - n;
+        const cv::Vec2f *row = spectrum.ptr<cv::Vec2f>(y);
+        for (int x = 0; x < n; ++x)
+        {
+            int fx = x <= n / 2 ? x : x - n;
+            if (fx == 0 && fy == 0)
+            {
+                continue;
+            }
+            double power = static_cast<double>(row[x][0]) * row[x][0] + static_cast<double>(row[x][1]) * row[x][1];
+            acc.total_energy += power;
+            if (static_cast<float>(fx * fx + fy * fy) >= cutoff_sq)
+            {
+                acc.hf_energy += power;
+            }
+        }
+    }
+}
+
+static FrameRating finish_rating(TileAccumulator &acc)
+{
+    double n = static_cast<double>(acc.count);
+    FrameRating rating;
+
+    double lap_mean = acc.lap_sum / n;
+    rating.metrics[static_cast<int>(RatingMetric::Laplacian)] =
+        static_cast<float>(acc.lap_sq / n - lap_mean * lap_mean);
+
+    rating.metrics[static_cast<int>(RatingMetric::Tenengrad)] = static_cast<float>(acc.grad_sq / n);
+
+    double pix_mean = acc.pix_sum / n;
+    double pix_var = acc.pix_sq / n - pix_mean * pix_mean;
+    rating.metrics[static_cast<int>(RatingMetric::NormalizedVariance)] =
+        pix_mean > 0.0 ? static_cast<float>(pix_var / pix_mean) : 0.f;
+
+    rating.metrics[static_cast<int>(RatingMetric::HighFrequency)] =
+        acc.total_energy > 0.0 ? static_cast<float>(acc.hf_energy / acc.total_energy) : 0.f;
+
+    // Percentile rather than mean so dark sky tiles don't dilute the score
+    auto p90 = acc.contrasts.begin() + static_cast<long>(acc.contrasts.size() * 9 / 10);
+    std::nth_element(acc.contrasts.begin(), p90, acc.contrasts.end());
+    rating.metrics[static_cast<int>(RatingMetric::LocalContrast)] = *p90;
 
-    cv::Scalar mean, stddev;
-    cv::meanStdDev(laplacianMat, mean, stddev);
+    rating.tile_map = acc.tile_map;
 
-    return static_cast<float>(stddev[0] * stddev[0]);
+    return rating;
 }
 
 #if 0
@@ -2,17 +2,83 @@
 #include "fits.hpp"
 #include "commands.hpp"
 #include "result.hpp"
+#include <array>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
+
+enum class RatingMetric
+{
+    Laplacian,          // variance of the Laplacian of the blurred green channel
+    Tenengrad,          // mean squared Sobel gradient magnitude
+    NormalizedVariance, // intensity variance divided by mean intensity
+    HighFrequency,      // share of spectral energy above a quarter of Nyquist
+    LocalContrast,      // 90th percentile of per-tile RMS contrast
+};
+
+inline constexpr int kRatingMetricCount = 5;
+
+inline constexpr int kRatingTileSize = 128;
+inline constexpr int kRatingTileMargin = 3; // 5x5 blur + 3x3 Laplacian support
+
+/// Name of the FITS image extension holding the per-tile quality map.
+inline constexpr const char *kQualityMapExtension = "QMAP";
+
+/// All metrics of one frame, indexed by RatingMetric.
+struct FrameRating
+{
+    std::array<float, kRatingMetricCount> metrics{};
+
+    /// Laplacian variance of every kRatingTileSize tile (CV_32F, NaN for tiles a sampled pass skipped).
+    cv::Mat tile_map;
+
+    /// Tile sampling the metrics were computed with; 1 is an exact, full-resolution rating.
+    int sampling = 1;
+
+    float operator[](RatingMetric metric) const
+    {
+        return metrics[static_cast<int>(metric)];
+    }
+};
+
+std::optional<RatingMetric> parse_rating_metric(const std::string &name);
+std::string_view rating_metric_name(RatingMetric metric);
+
+/// FITS header keywords the rating metadata is stored under, in RatingMetric order followed by QUALITY, QMETRIC
+/// and QAPPROX (tile sampling of an approximate rating, absent for exact ones).
+const std::vector<std::string> &rating_keywords();
 
 class FrameEvaluation
 {
   public:
     FrameEvaluation() = default;
+    explicit FrameEvaluation(RatingMetric metric);
+
+    /// Full-resolution score of the selected metric.
     std::optional<float> rate_image(FitsFile &image);
 
+    /// Laplacian variance and its tile map only, from one full-resolution read of the green channel. Skips the
+    /// Sobel, spectrum and contrast work of rate_metrics; the other metrics are NaN.
+    std::optional<FrameRating> rate_laplacian(FitsFile &image);
+
+    /// Every metric from a single read of the green channel and one tiled pass over it.
+    /// sampling > 1 visits only a fixed, evenly spread subset of tiles covering about 1/sampling of the frame;
+    /// the result estimates the same quantities, so exact and approximate scores can be ranked together.
+    std::optional<FrameRating> rate_metrics(FitsFile &image, int sampling = 1);
+
+    /// Store all metrics plus the ranked score in the header of an already written frame, marked with QAPPROX when
+    /// they are approximate, and the tile map as a kQualityMapExtension image extension.
+    la_result write_metrics(FitsFile &file, const FrameRating &rating) const;
+
+    RatingMetric metric() const
+    {
+        return metric_;
+    }
+
   private:
-    
+    RatingMetric metric_ = RatingMetric::Laplacian;
 };
 
 la_result run_rate(std::unordered_map<std::string, std::string> &args, PipelineContext &ctx);
@@ -1,16 +1,27 @@
 #include "registration.hpp"
 #include "rate.hpp"
 #include "result.hpp"
+#include <algorithm>
+#include <cfloat>
 #include <cstdint>
 #include <filesystem>
 #include <fitsio.h>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <optional>
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 #include <print>
+#include <sstream>
 #include <string.h>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include "fits.hpp"
@@ -20,6 +31,282 @@
 
 namespace fs = std::filesystem;
 
+static constexpr int kTrackingChunkSize = 32;
+static constexpr int kMaxRotationRounds = 6;
+static constexpr double kRotationResidualDeg = 0.05;
+
+static std::optional<cv::Rect> parse_roi(const std::string &value)
+{
+    cv::Rect roi;
+    char c1 = 0, c2 = 0, c3 = 0;
+    std::istringstream stream(value);
+    if (!(stream >> roi.x >> c1 >> roi.y >> c2 >> roi.width >> c3 >> roi.height) || c1 != ',' || c2 != ',' ||
+        c3 != ',' || !stream.eof())
+        return std::nullopt;
+    if (roi.x < 0 || roi.y < 0 || std::min(roi.width, roi.height) < kMinRoiSize)
+        return std::nullopt;
+    return roi;
+}
+
+// "<angles>x<radii>", returned as width = angles and height = radii
+static std::optional<cv::Size> parse_polar_grid(const std::string &value)
+{
+    cv::Size grid;
+    char x = 0;
+    std::istringstream stream(value);
+    if (!(stream >> grid.width >> x >> grid.height) || x != 'x' || !stream.eof())
+        return std::nullopt;
+    if (grid.width < 16 || grid.height < 16)
+        return std::nullopt;
+    return grid;
+}
+
+// Constant-velocity prediction of the next frame's registration from the ones before it
+struct MotionTracker
+{
+    RegistrationPrior predict() const
+    {
+        RegistrationPrior prior;
+        if (last.has_value())
+            prior.shift = *last + velocity;
+        prior.rotationAngleDeg = rotation;
+        prior.scalingRatio = scale;
+        return prior;
+    }
+
+    void update(const RegistrationResult &res)
+    {
+        cv::Point2d shift(res.dx, res.dy);
+        if (last.has_value())
+        {
+            // Smoothed, as seeing jitter dominates the frame-to-frame motion
+            velocity = 0.5 * velocity + 0.5 * (shift - *last);
+        }
+        last = shift;
+        rotation = res.rotationAngleDeg;
+        scale = res.scalingRatio;
+    }
+
+    std::optional<cv::Point2d> last;
+    cv::Point2d velocity{0, 0};
+    double rotation = 0;
+    double scale = 1;
+};
+
+// Least-squares polynomial through the inlier samples, evaluated at 0..count-1. The degree drops to what
+// the sample count supports; samples further than three (scaled) median absolute deviations from the fit are
+// dropped and the fit is repeated.
+static std::vector<double> robust_fit(const std::vector<int> &frames, const std::vector<double> &values, int count,
+                                      std::vector<double> &residuals)
+{
+    const int n = static_cast<int>(frames.size());
+    const double span = std::max(count - 1, 1);
+    auto t = [&](double frame) { return 2.0 * frame / span - 1.0; };
+
+    std::vector<bool> inlier(n, true);
+    cv::Mat coef = cv::Mat::zeros(1, 1, CV_64F);
+    residuals.assign(n, 0.0);
+
+    for (int pass = 0; pass < 4; ++pass)
+    {
+        int m = static_cast<int>(std::count(inlier.begin(), inlier.end(), true));
+        if (m == 0)
+            break;
+        int degree = m >= 6 ? 2 : m >= 2 ? 1 : 0;
+
+        cv::Mat A(m, degree + 1, CV_64F), b(m, 1, CV_64F);
+        for (int i = 0, row = 0; i < n; ++i)
+        {
+            if (!inlier[i])
+                continue;
+            for (int d = 0; d <= degree; ++d)
+                A.at<double>(row, d) = std::pow(t(frames[i]), d);
+            b.at<double>(row++) = values[i];
+        }
+        cv::solve(A, b, coef, cv::DECOMP_SVD);
+
+        std::vector<double> deviations;
+        for (int i = 0; i < n; ++i)
+        {
+            double fit = 0.0;
+            for (int d = 0; d < coef.rows; ++d)
+                fit += coef.at<double>(d) * std::pow(t(frames[i]), d);
+            residuals[i] = values[i] - fit;
+            if (inlier[i])
+                deviations.push_back(std::abs(residuals[i]));
+        }
+
+        std::nth_element(deviations.begin(), deviations.begin() + deviations.size() / 2, deviations.end());
+        double limit = std::max(3.0 * 1.4826 * deviations[deviations.size() / 2], 1e-9);
+
+        bool changed = false;
+        for (int i = 0; i < n; ++i)
+        {
+            bool keep = std::abs(residuals[i]) <= limit;
+            changed |= keep != inlier[i];
+            inlier[i] = keep;
+        }
+        if (!changed)
+            break;
+    }
+
+    std::vector<double> fitted(count);
+    for (int frame = 0; frame < count; ++frame)
+    {
+        double fit = 0.0;
+        for (int d = 0; d < coef.rows; ++d)
+            fit += coef.at<double>(d) * std::pow(t(frame), d);
+        fitted[frame] = fit;
+    }
+    return fitted;
+}
+
+// Rotation and scale of every frame from measurements on every k-th frame in capture order. Intervals whose
+// end samples disagree with the fit by more than kRotationResidualDeg are bisected and measured again.
+static std::vector<RegistrationPrior> fit_rotation(const std::vector<fs::path> &fits_files,
+                                                   const FFTRegistration &runner, const RegistrationOptions &options)
+{
+    const int count = static_cast<int>(fits_files.size());
+    if (count == 0)
+        return {};
+
+    std::map<int, RegistrationResult> samples;
+
+    auto measure = [&](const std::vector<int> &frames) {
+#ifdef LUNALIGN_USE_OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (int j = 0; j < static_cast<int>(frames.size()); ++j)
+        {
+            auto fits_file = FitsFile(fits_files[frames[j]], FitsFile::Mode::ReadOnly);
+            RegistrationResult res = runner.measureRotationScale(fits_file.readToCvMat<uint16_t>());
+#ifdef LUNALIGN_USE_OPENMP
+#pragma omp critical(rotation_samples)
+#endif
+            samples[frames[j]] = res;
+        }
+    };
+
+    std::vector<int> pending;
+    for (int i = 0; i < count; i += options.rotationEvery)
+        pending.push_back(i);
+    if (pending.back() != count - 1)
+        pending.push_back(count - 1);
+
+    std::vector<double> angles(count, 0.0), scales(count, 1.0);
+    for (int round = 0; round < kMaxRotationRounds && !pending.empty(); ++round)
+    {
+        measure(pending);
+        pending.clear();
+
+        // Samples with a weak rotation peak do not take part in the fit
+        std::vector<int> frames;
+        std::vector<double> sampleAngles, sampleScales;
+        for (const auto &[frame, res] : samples)
+        {
+            if (options.minPsr > 0 && res.rotationPsr < options.minPsr)
+                continue;
+            frames.push_back(frame);
+            sampleAngles.push_back(res.rotationAngleDeg);
+            sampleScales.push_back(res.scalingRatio);
+        }
+        if (frames.empty())
+            break;
+
+        std::vector<double> angleResiduals, scaleResiduals;
+        angles = robust_fit(frames, sampleAngles, count, angleResiduals);
+        scales = robust_fit(frames, sampleScales, count, scaleResiduals);
+
+        for (size_t k = 0; k + 1 < frames.size(); ++k)
+        {
+            int a = frames[k], b = frames[k + 1];
+            double residual = std::max(std::abs(angleResiduals[k]), std::abs(angleResiduals[k + 1]));
+            if (b - a > 1 && residual > kRotationResidualDeg && !samples.contains((a + b) / 2))
+                pending.push_back((a + b) / 2);
+        }
+    }
+
+    std::println("Measured rotation on {} of {} frames", samples.size(), count);
+
+    std::vector<RegistrationPrior> fit(count);
+    for (int i = 0; i < count; ++i)
+    {
+        fit[i].fixedRotation = true;
+        fit[i].rotationAngleDeg = options.enableRotation ? angles[i] : 0.0;
+        fit[i].scalingRatio = options.enableScaling ? scales[i] : 1.0;
+    }
+    return fit;
+}
+
+static std::optional<RegistrationEngine> parse_engine(const std::string &name)
+{
+    if (name == "fft")
+        return RegistrationEngine::FFT;
+    if (name == "centroid")
+        return RegistrationEngine::Centroid;
+    if (name == "hybrid")
+        return RegistrationEngine::Hybrid;
+    return std::nullopt;
+}
+
+static void print_result(const std::string &image_name, const RegistrationResult &res)
+{
+    std::println("[FFTReg] {} dx={:.2f}  dy={:.2f} rot={:.2f}°  scale={:.4f}  psr={:.1f}{}", image_name, res.dx,
+                 res.dy, res.rotationAngleDeg, res.scalingRatio, res.psr, res.tracked ? "  (tracked)" : "");
+}
+
+// The tile quality map of a frame (see rate.hpp) moved onto the tile grid of its registered frame with the
+// global transform warp applies. Each output tile takes the input tile under the source position of its centre,
+// or 0, the lowest score, where that falls outside the frame and the registered frame is black. Local shifts are
+// a fraction of a tile and are left out.
+static cv::Mat warp_tile_map(const cv::Mat &tileMap, cv::Size frameSize, const RegistrationResult &res)
+{
+    cv::Point2f ctr(frameSize.width / 2.f, frameSize.height / 2.f);
+    cv::Mat M = cv::getRotationMatrix2D(ctr, -res.rotationAngleDeg, res.scalingRatio);
+    M.at<double>(0, 2) -= res.dx;
+    M.at<double>(1, 2) -= res.dy;
+    cv::Mat Minv;
+    cv::invertAffineTransform(M, Minv);
+    const double *m = Minv.ptr<double>();
+
+    cv::Mat warped(tileMap.size(), CV_32F);
+    for (int ty = 0; ty < tileMap.rows; ++ty)
+    {
+        // Centre of the tile as rate clips it at the frame edge
+        int y0 = ty * kRatingTileSize;
+        double y = y0 + std::min(kRatingTileSize, frameSize.height - y0) / 2.0;
+        for (int tx = 0; tx < tileMap.cols; ++tx)
+        {
+            int x0 = tx * kRatingTileSize;
+            double x = x0 + std::min(kRatingTileSize, frameSize.width - x0) / 2.0;
+
+            double sx = m[0] * x + m[1] * y + m[2], sy = m[3] * x + m[4] * y + m[5];
+            bool inside = sx >= 0 && sy >= 0 && sx < frameSize.width && sy < frameSize.height;
+            int stx = static_cast<int>(sx) / kRatingTileSize, sty = static_cast<int>(sy) / kRatingTileSize;
+            warped.at<float>(ty, tx) = inside ? tileMap.at<float>(sty, stx) : 0.f;
+        }
+    }
+    return warped;
+}
+
+static std::string_view rejection_reason(const RegistrationResult &res, const RegistrationOptions &options)
+{
+    // The centroid has no correlation peak to judge, only whether there was a disk at all
+    if (options.engine == RegistrationEngine::Centroid)
+    {
+        if (res.response <= 0)
+            return "no disk";
+    }
+    else if (options.minPsr > 0 && res.psr < options.minPsr)
+        return "low confidence";
+    bool polar = options.enableRotation || options.enableScaling;
+    if (options.minPsr > 0 && polar && res.rotationMeasured && res.rotationPsr < options.minPsr)
+        return "low rotation confidence";
+    if (options.maxShift > 0 && std::hypot(res.dx, res.dy) > options.maxShift)
+        return "large shift";
+    return {};
+}
+
 la_result run_registration(std::unordered_map<std::string, std::string> &args, PipelineContext &ctx)
 {
     fs::path input_dir = args["in"];
@@ -29,6 +316,97 @@ la_result run_registration(std::unordered_map<std::string, std::string> &args, P
     bool enable_rot = std::stoi(args["rotation"]) != 0;
     bool enable_scale = std::stoi(args["scaling"]) != 0;
     bool enable_highpass = std::stoi(args["highpass"]) != 0;
+    int pyramid = std::stoi(args["pyramid"]);
+    double tolerance = std::stod(args["tolerance"]);
+
+    RegistrationOptions options{enable_rot, enable_scale, enable_highpass, FFTBackend::create(args["fft"]), pyramid,
+                                tolerance};
+    if (!options.fft)
+    {
+        std::println(std::cerr, "Error: FFT backend '{}' is not available in this build.", args["fft"]);
+        return la_result::Error;
+    }
+    if (pyramid < 1 || pyramid > 16)
+    {
+        std::println(std::cerr, "Error: Pyramid downsampling factor must be between 1 and 16.");
+        return la_result::Error;
+    }
+    auto interpolation = parse_interpolation(args["interp"]);
+    if (!interpolation.has_value())
+    {
+        std::println(std::cerr, "Error: Unknown interpolation '{}'.", args["interp"]);
+        return la_result::Error;
+    }
+    options.interpolation = interpolation.value();
+    options.minPsr = std::stod(args["minpsr"]);
+    options.maxShift = std::stod(args["maxshift"]);
+    if (!args["polar"].empty())
+    {
+        auto grid = parse_polar_grid(args["polar"]);
+        if (!grid.has_value())
+        {
+            std::println(std::cerr, "Error: Polar grid must be given as <angles>x<radii>, e.g. 720x256.");
+            return la_result::Error;
+        }
+        options.polarAngles = grid->width;
+        options.polarRadii = grid->height;
+    }
+    options.rotationEvery = std::stoi(args["rotevery"]);
+    if (options.rotationEvery < 1)
+    {
+        std::println(std::cerr, "Error: Rotation sampling interval must be at least 1.");
+        return la_result::Error;
+    }
+    options.upsample = std::stoi(args["upsample"]);
+    if (options.upsample < 0 || options.upsample > 200)
+    {
+        std::println(std::cerr, "Error: Upsampling factor must be between 0 and 200.");
+        return la_result::Error;
+    }
+    options.apSize = std::stoi(args["ap"]);
+    if (options.apSize != 0 && options.apSize < 16)
+    {
+        std::println(std::cerr, "Error: Alignment point size must be at least 16 pixels.");
+        return la_result::Error;
+    }
+    options.apContrast = std::stod(args["apcontrast"]);
+    auto engine = parse_engine(args["engine"]);
+    if (!engine.has_value())
+    {
+        std::println(std::cerr, "Error: Unknown registration engine '{}'.", args["engine"]);
+        return la_result::Error;
+    }
+    options.engine = engine.value();
+    if (options.engine != RegistrationEngine::FFT && (enable_rot || enable_scale))
+    {
+        std::println(std::cerr, "Error: The {} engine measures translation only, use -engine=fft for rotation.",
+                     args["engine"]);
+        return la_result::Error;
+    }
+    if (options.engine == RegistrationEngine::Centroid && options.apSize > 0)
+    {
+        std::println(std::cerr, "Error: Alignment points need the fft or hybrid engine.");
+        return la_result::Error;
+    }
+    options.cacheDir = args["cache"];
+    options.tracking = std::stoi(args["track"]) != 0;
+    options.trackingMinPsr = std::stod(args["trackpsr"]);
+
+    if (args["roi"] == "auto")
+    {
+        options.autoRoi = true;
+    }
+    else if (!args["roi"].empty())
+    {
+        auto roi = parse_roi(args["roi"]);
+        if (!roi.has_value())
+        {
+            std::println(std::cerr, "Error: ROI must be 'auto' or x,y,w,h with w and h of at least {} pixels.",
+                         kMinRoiSize);
+            return la_result::Error;
+        }
+        options.roi = roi.value();
+    }
 
     fs::path reference_file = input_dir / reference_filename;
 
@@ -41,35 +419,157 @@ la_result run_registration(std::unordered_map<std::string, std::string> &args, P
             fits_files.push_back(dir_entry.path());
     }
 
+    // Capture order, with frame numbers compared numerically
+    std::sort(fits_files.begin(), fits_files.end(), [](const fs::path &a, const fs::path &b) {
+        std::string na = a.filename().string(), nb = b.filename().string();
+        return na.size() != nb.size() ? na.size() < nb.size() : na < nb;
+    });
+
     auto fits_ref = FitsFile(reference_file, FitsFile::Mode::ReadOnly);
 
     auto image_mat_ref = fits_ref.readToCvMat<uint16_t>();
 
-    FFTRegistration register_runner = FFTRegistration(image_mat_ref, enable_rot, enable_scale, enable_highpass);
+    if ((options.roi & cv::Rect(0, 0, image_mat_ref.cols, image_mat_ref.rows)) != options.roi)
+    {
+        std::println(std::cerr, "Error: ROI lies outside the {}x{} reference frame.", image_mat_ref.cols,
+                     image_mat_ref.rows);
+        return la_result::Error;
+    }
+
+    // The hybrid engine runs both: the centroid shift seeds the windowed phase correlation
+    std::optional<CentroidRegistration> centroid_runner;
+    std::optional<FFTRegistration> register_runner;
+    if (options.engine != RegistrationEngine::FFT)
+        centroid_runner.emplace(image_mat_ref, options);
+    if (options.engine != RegistrationEngine::Centroid)
+        register_runner.emplace(image_mat_ref, options);
+    if (register_runner && register_runner->referenceFromCache())
+    {
+        std::println("Prepared reference loaded from {}", options.cacheDir);
+    }
+
+    if (options.apSize > 0)
+    {
+        std::println("Alignment points: {}", register_runner->alignmentPointCount());
+    }
+
+    // Rotation measured on a subset of frames and fitted over capture order
+    std::vector<RegistrationPrior> rotation_fit;
+    if (options.rotationEvery > 1 && (options.enableRotation || options.enableScaling))
+        rotation_fit = fit_rotation(fits_files, *register_runner, options);
+
+    std::unordered_map<std::string_view, int> rejected;
+    int written = 0;
+
+    // With tracking, frames are registered in capture order inside each chunk, so every frame but the first
+    // of a chunk has a prediction from its predecessors. Chunks run in parallel.
+    const int frame_count = static_cast<int>(fits_files.size());
+    const int chunk_size = options.tracking ? kTrackingChunkSize : 1;
+    const int chunk_count = (frame_count + chunk_size - 1) / chunk_size;
 
 #ifdef LUNALIGN_USE_OPENMP
 #pragma omp parallel for schedule(dynamic)
 #endif
-    for (int i = 0; i < static_cast<int>(fits_files.size()); ++i)
+    for (int chunk = 0; chunk < chunk_count; ++chunk)
     {
-        const auto &path = fits_files[i];
-        const auto &path_str = path.filename().string();
+        MotionTracker tracker;
+
+        for (int i = chunk * chunk_size; i < std::min((chunk + 1) * chunk_size, frame_count); ++i)
+        {
+            const auto &path = fits_files[i];
+            const auto &path_str = path.filename().string();
+
+            auto fits_file = FitsFile(path, FitsFile::Mode::ReadOnly);
+            auto image_mat = fits_file.readToCvMat<uint16_t>();
+
+            RegistrationResult res;
+            cv::Mat prepared;
+            if (options.engine == RegistrationEngine::Centroid)
+            {
+                res = centroid_runner->evaluate(image_mat);
+            }
+            else
+            {
+                RegistrationPrior prior = tracker.predict();
+                if (centroid_runner)
+                {
+                    // A measured centroid beats the prediction from earlier frames
+                    RegistrationResult coarse = centroid_runner->evaluate(image_mat);
+                    if (coarse.response > 0)
+                        prior.shift = cv::Point2d(coarse.dx, coarse.dy);
+                }
+                if (!rotation_fit.empty())
+                {
+                    prior.fixedRotation = true;
+                    prior.rotationAngleDeg = rotation_fit[i].rotationAngleDeg;
+                    prior.scalingRatio = rotation_fit[i].scalingRatio;
+                }
+                res = register_runner->evaluate(image_mat, prior, &prepared);
+            }
+            print_result(path_str, res);
+
+            // Frames that did not register are neither warped nor written, nor used for prediction
+            std::string_view reason = rejection_reason(res, options);
+            if (!reason.empty())
+            {
+#ifdef LUNALIGN_USE_OPENMP
+#pragma omp critical(registration_summary)
+#endif
+                ++rejected[reason];
+                std::println("  rejected file {} ({}): psr={:.1f} rotation psr={:.1f} shift={:.1f}", path_str,
+                             reason, res.psr, res.rotationPsr, std::hypot(res.dx, res.dy));
+                continue;
+            }
+            tracker.update(res);
+
+            cv::Mat aligned;
+            if (register_runner)
+            {
+                register_runner->measureLocalShifts(image_mat, res, prepared);
+                aligned = register_runner->warp(image_mat, res);
+            }
+            else
+            {
+                aligned = centroid_runner->warp(image_mat, res);
+            }
+
+            fs::path output_filename = output_dir / ("registered_" + path_str);
+            std::println("Registered file: {}", path_str);
+            std::string create_path = "!" + output_filename.string();
+            auto out_file = FitsFile(create_path, FitsFile::Mode::Create);
+            out_file.writeCvMat<uint16_t>(aligned);
+            out_file.copyKeys(fits_file, rating_keywords());
+            cv::Mat quality_map = fits_file.readExtension(kQualityMapExtension);
+            if (!quality_map.empty())
+            {
+                out_file.writeExtension(kQualityMapExtension, warp_tile_map(quality_map, image_mat.size(), res));
+            }
+            out_file.writeKey("REGPSR", res.psr, "registration peak-to-sidelobe ratio");
+            out_file.writeKey("REGRESP", res.response, "registration peak response");
+
+#ifdef LUNALIGN_USE_OPENMP
+#pragma omp atomic
+#endif
+            ++written;
+        }
+    }
 
-        auto fits_file = FitsFile(path, FitsFile::Mode::ReadOnly);
-        auto image_mat = fits_file.readToCvMat<uint16_t>();
-        auto aligned = register_runner.align(path_str, image_mat);
+    int rejected_total = static_cast<int>(fits_files.size()) - written;
+    if (rejected_total > 0)
+    {
+        std::println("\nRejected {} of {} frames: {}", rejected_total, fits_files.size(), rejected);
+    }
 
-        fs::path output_filename = output_dir / ("registered_" + path_str);
-        std::println("Registered file: {}", path_str);
-        std::string create_path = "!" + output_filename.string();
-        auto out_file = FitsFile(create_path, FitsFile::Mode::Create);
-        out_file.writeCvMat<uint16_t>(aligned);
+    if (written == 0)
+    {
+        std::println(std::cerr, "Error: No frame passed registration.");
+        return la_result::Error;
     }
 
     return la_result::Ok;
 }
 
-cv::Mat FFTRegistration::toGray32F(const cv::Mat &src)
+cv::Mat FFTRegistration::toGray32F(const cv::Mat &src, std::vector<uint32_t> &histogram, float &binScale)
 {
     cv::Mat gray;
     if (src.channels() > 1)
@@ -77,60 +577,154 @@ cv::Mat FFTRegistration::toGray32F(const cv::Mat &src)
     else
         gray = src;
 
+    // Integer frames are binned by their exact code, so the median taken from the histogram is the exact one
+    if (gray.depth() == CV_16U || gray.depth() == CV_8U)
+    {
+        bool wide = gray.depth() == CV_16U;
+        binScale = wide ? 1.0f / 65535.0f : 1.0f / 255.0f;
+        histogram.assign(wide ? 65536 : 256, 0);
+
+        cv::Mat f(gray.size(), CV_32F);
+        for (int r = 0; r < gray.rows; ++r)
+        {
+            float *dst = f.ptr<float>(r);
+            if (wide)
+            {
+                const uint16_t *row = gray.ptr<uint16_t>(r);
+                for (int c = 0; c < gray.cols; ++c)
+                {
+                    dst[c] = row[c] * binScale;
+                    ++histogram[row[c]];
+                }
+            }
+            else
+            {
+                const uint8_t *row = gray.ptr<uint8_t>(r);
+                for (int c = 0; c < gray.cols; ++c)
+                {
+                    dst[c] = row[c] * binScale;
+                    ++histogram[row[c]];
+                }
+            }
+        }
+        return f;
+    }
+
     cv::Mat f;
     switch (gray.depth())
     {
     case CV_32F:
-        return gray.clone();
+        f = gray.clone();
+        break;
     case CV_64F:
         gray.convertTo(f, CV_32F);
-        return f;
-    case CV_16U:
-        gray.convertTo(f, CV_32F, 1.0 / 65535.0);
-        return f;
-    case CV_8U:
-        gray.convertTo(f, CV_32F, 1.0 / 255.0);
-        return f;
+        break;
     default:
         gray.convertTo(f, CV_32F);
         cv::normalize(f, f, 0, 1, cv::NORM_MINMAX);
-        return f;
+        break;
     }
+
+    // Other depths are quantised to 16 bits over [0, 1], which makes the median approximate. Bin 0 holds exact
+    // zeros only, as for integer frames, so preprocess fills the same pixels it counts.
+    binScale = 1.0f / 65535.0f;
+    histogram.assign(65536, 0);
+    for (int r = 0; r < f.rows; ++r)
+    {
+        const float *row = f.ptr<float>(r);
+        for (int c = 0; c < f.cols; ++c)
+        {
+            if (row[c] == 0.f)
+                ++histogram[0];
+            else if (row[c] > 0.f)
+                ++histogram[std::clamp(static_cast<int>(row[c] * 65535.0f + 0.5f), 1, 65535)];
+        }
+    }
+    return f;
+}
+
+void FFTRegistration::blurLarge(const cv::Mat &src, cv::Mat &dst, double sigma)
+{
+    // Decimation factor that leaves a blur of at least 3 pixels to do on the small image
+    int factor = 1;
+    while (sigma / (factor * 2) >= kDecimatedBlurSigma)
+        factor *= 2;
+
+    if (factor == 1)
+    {
+        cv::GaussianBlur(src, dst, cv::Size(0, 0), sigma);
+        return;
+    }
+
+    // Area downsampling adds a box of width factor, linear upsampling a triangle of half-width factor.
+    // Their variances are taken off the Gaussian done at the reduced size.
+    double residual = sigma * sigma - (factor * factor - 1) / 12.0 - factor * factor / 6.0;
+    double smallSigma = std::sqrt(residual) / factor;
+
+    int padX = (factor - src.cols % factor) % factor;
+    int padY = (factor - src.rows % factor) % factor;
+    cv::Mat padded = src;
+    if (padX || padY)
+        cv::copyMakeBorder(src, padded, 0, padY, 0, padX, cv::BORDER_REFLECT_101);
+
+    cv::Mat small;
+    cv::resize(padded, small, cv::Size(padded.cols / factor, padded.rows / factor), 0, 0, cv::INTER_AREA);
+    cv::GaussianBlur(small, small, cv::Size(0, 0), smallSigma);
+    cv::resize(small, padded, padded.size(), 0, 0, cv::INTER_LINEAR);
+
+    dst = padded(cv::Rect(0, 0, src.cols, src.rows));
 }
 
-cv::Mat FFTRegistration::preprocess(const cv::Mat &src) const
+cv::Mat FFTRegistration::preprocess(const cv::Mat &src, int downsample) const
 {
-    cv::Mat img = toGray32F(src);
+    std::vector<uint32_t> histogram;
+    float binScale = 1.0f;
+    cv::Mat img = toGray32F(src, histogram, binScale);
+
+    // Fill pure-black pixels with the median of the others, taken from the histogram built
+    // during conversion. Prevents false edges at rotated-image borders.
+    size_t positive = 0;
+    for (size_t b = 1; b < histogram.size(); ++b)
+        positive += histogram[b];
 
-    // Fill pure-black pixels with the median.
-    // Prevents false edges at rotated-image borders.
+    if (positive > 0 && histogram[0] > 0)
     {
-        std::vector<float> vals;
-        vals.reserve(img.total());
-        const float *p = img.ptr<float>();
-        for (size_t i = 0; i < img.total(); ++i)
-            if (p[i] > 0.f)
-                vals.push_back(p[i]);
-        if (!vals.empty())
+        size_t b = 1;
+        for (size_t seen = histogram[1]; seen <= positive / 2; seen += histogram[++b])
+            ;
+        float med = b * binScale;
+
+        for (int r = 0; r < img.rows; ++r)
         {
-            std::nth_element(vals.begin(), vals.begin() + (long)(vals.size() / 2), vals.end());
-            float med = vals[vals.size() / 2];
-            float *q = img.ptr<float>();
-            for (size_t i = 0; i < img.total(); ++i)
-                if (q[i] == 0.f)
-                    q[i] = med;
+            float *q = img.ptr<float>(r);
+            for (int c = 0; c < img.cols; ++c)
+                if (q[c] == 0.f)
+                    q[c] = med;
         }
     }
 
     cv::Mat result;
+    float lo = FLT_MAX, hi = -FLT_MAX;
 
     if (useHighpass)
     {
         // Highpass = image − heavily-blurred copy.
         // Preserves more structure than a gradient on smooth lunar surfaces.
         cv::Mat blurred;
-        cv::GaussianBlur(img, blurred, cv::Size(0, 0), 15);
-        result = img - blurred;
+        blurLarge(img, blurred, 15.0 / downsample);
+
+        result = img;
+        for (int r = 0; r < result.rows; ++r)
+        {
+            float *q = result.ptr<float>(r);
+            const float *b = blurred.ptr<float>(r);
+            for (int c = 0; c < result.cols; ++c)
+            {
+                q[c] -= b[c];
+                lo = std::min(lo, q[c]);
+                hi = std::max(hi, q[c]);
+            }
+        }
     }
     else
     {
@@ -139,51 +733,95 @@ cv::Mat FFTRegistration::preprocess(const cv::Mat &src) const
         cv::Mat gx, gy;
         cv::Scharr(img, gx, CV_32F, 1, 0);
         cv::Scharr(img, gy, CV_32F, 0, 1);
-        cv::magnitude(gx, gy, result);
+
+        result.create(img.size(), CV_32F);
+        for (int r = 0; r < result.rows; ++r)
+        {
+            const float *x = gx.ptr<float>(r);
+            const float *y = gy.ptr<float>(r);
+            float *q = result.ptr<float>(r);
+            for (int c = 0; c < result.cols; ++c)
+            {
+                q[c] = std::sqrt(x[c] * x[c] + y[c] * y[c]);
+                lo = std::min(lo, q[c]);
+                hi = std::max(hi, q[c]);
+            }
+        }
+    }
+
+    // Normalise, suppress the bottom 25 % and normalise again, in one pass: the second
+    // normalisation only stretches [0.25, 1] back to [0, 1]
+    float range = hi - lo;
+    if (!(range > 0.f))
+    {
+        result.setTo(0);
+        return result;
     }
 
-    // Normalise and suppress the bottom 25 %
-    cv::normalize(result, result, 0, 1, cv::NORM_MINMAX);
-    result = cv::max(result - 0.25f, 0.f);
-    cv::normalize(result, result, 0, 1, cv::NORM_MINMAX);
+    float threshold = lo + 0.25f * range;
+    float scale = 1.0f / (0.75f * range);
+    for (int r = 0; r < result.rows; ++r)
+    {
+        float *q = result.ptr<float>(r);
+        for (int c = 0; c < result.cols; ++c)
+            q[c] = std::max(q[c] - threshold, 0.f) * scale;
+    }
 
     return result;
 }
 
-cv::Mat FFTRegistration::computeMagnitudeSpectrum(const cv::Mat &img, int size) const
+cv::Mat FFTRegistration::computeMagnitudeSpectrum(const cv::Mat &img, const PolarReference &polar) const
 {
-    // Pad into optimal-size square
+    // Pad into optimal-size square, applying the 2-D Hann window on the way
+    // to reduce spectral leakage
+    int size = polar.size;
     cv::Mat padded = cv::Mat::zeros(size, size, CV_32F);
-    int ox = (size - img.cols) / 2;
-    int oy = (size - img.rows) / 2;
-    img.copyTo(padded(cv::Rect(ox, oy, img.cols, img.rows)));
+    cv::Rect roi((size - img.cols) / 2, (size - img.rows) / 2, img.cols, img.rows);
+    cv::multiply(img, polar.window(roi), padded(roi));
 
-    // 2-D Hann window to reduce spectral leakage
-    cv::Mat hann;
-    cv::createHanningWindow(hann, padded.size(), CV_32F);
-    padded = padded.mul(hann);
-
-    // Forward DFT
-    cv::Mat planes[] = {padded, cv::Mat::zeros(size, size, CV_32F)};
+    // Forward DFT of the real input
     cv::Mat cpx;
-    cv::merge(planes, 2, cpx);
-    cv::dft(cpx, cpx);
-
-    // |DFT|
-    cv::split(cpx, planes);
-    cv::Mat mag;
-    cv::magnitude(planes[0], planes[1], mag);
+    fft_->forward(padded, cpx);
 
-    // This is the critical missing step.  Without it the polar image is
+    // log(|DFT| + 1) in one pass.  Without the log the polar image is
     // dominated by the DC spike and has no usable high-freq content.
-    cv::log(mag + 1.0f, mag);
+    int half = size / 2 + 1;
+    cv::Mat mag(size, size, CV_32F);
+    for (int r = 0; r < size; ++r)
+    {
+        const float *src = cpx.ptr<float>(r);
+        float *dst = mag.ptr<float>(r);
+        for (int c = 0; c < half; ++c)
+        {
+            float re = src[2 * c], im = src[2 * c + 1];
+            dst[c] = std::log(std::sqrt(re * re + im * im) + 1.0f);
+        }
+    }
+
+    // The magnitude of a real input's spectrum is point-symmetric, so the columns a
+    // half-width backend leaves out are mirrored from the ones it returned
+    for (int r = 0; r < size; ++r)
+    {
+        const float *src = mag.ptr<float>((size - r) % size);
+        float *dst = mag.ptr<float>(r);
+        for (int c = half; c < size; ++c)
+            dst[c] = src[size - c];
+    }
 
     // Shift quadrants so zero-frequency is centred
-    int cx = mag.cols / 2, cy = mag.rows / 2;
-    cv::Mat q0(mag, cv::Rect(0, 0, cx, cy));
-    cv::Mat q1(mag, cv::Rect(cx, 0, cx, cy));
-    cv::Mat q2(mag, cv::Rect(0, cy, cx, cy));
-    cv::Mat q3(mag, cv::Rect(cx, cy, cx, cy));
+    fftShift(mag);
+
+    cv::normalize(mag, mag, 0, 1, cv::NORM_MINMAX);
+    return mag;
+}
+
+void FFTRegistration::fftShift(cv::Mat &m)
+{
+    int cx = m.cols / 2, cy = m.rows / 2;
+    cv::Mat q0(m, cv::Rect(0, 0, cx, cy));
+    cv::Mat q1(m, cv::Rect(cx, 0, cx, cy));
+    cv::Mat q2(m, cv::Rect(0, cy, cx, cy));
+    cv::Mat q3(m, cv::Rect(cx, cy, cx, cy));
     cv::Mat tmp;
     q0.copyTo(tmp);
     q3.copyTo(q0);
@@ -191,112 +829,307 @@ cv::Mat FFTRegistration::computeMagnitudeSpectrum(const cv::Mat &img, int size)
     q1.copyTo(tmp);
     q2.copyTo(q1);
     tmp.copyTo(q2);
-
-    cv::normalize(mag, mag, 0, 1, cv::NORM_MINMAX);
-    return mag;
 }
 
-void FFTRegistration::buildPolarRemapTables(int size)
+FFTRegistration::CorrelationPlan FFTRegistration::makePlan(const cv::Mat &ref) const
 {
-    polarMapX_ = cv::Mat(size, size, CV_32F);
-    polarMapY_ = cv::Mat(size, size, CV_32F);
+    CorrelationPlan plan;
+    plan.size = cv::Size(cv::getOptimalDFTSize(ref.cols), cv::getOptimalDFTSize(ref.rows));
+    cv::createHanningWindow(plan.window, plan.size, CV_32F);
 
-    float cx = size / 2.f;
-    float cy = size / 2.f;
-    float maxRadius = size / 2.f;
+    cv::Mat refPad;
+    cv::copyMakeBorder(ref, refPad, 0, plan.size.height - ref.rows, 0, plan.size.width - ref.cols,
+                       cv::BORDER_CONSTANT);
+    refPad = refPad.mul(plan.window);
 
-    for (int row = 0; row < size; ++row)
-    {
-        // angle ∈ [0, π)  mapped linearly over rows — matches PixInsight's
-        // polarTransform(0, Math.PI).
-        float angle = static_cast<float>(CV_PI) * row / size;
-        float cosA = std::cos(angle);
-        float sinA = std::sin(angle);
+    fft_->plan(plan.size);
+    fft_->forward(refPad, plan.refFFT);
+    return plan;
+}
 
-        for (int col = 0; col < size; ++col)
-        {
-            float radius;
-            if (enableScaling)
-            {
-                // Log-polar: col maps logarithmically to radius
-                radius = std::exp(static_cast<float>(col) * std::log(maxRadius) / size);
-            }
-            else
-            {
-                // Linear polar: col maps linearly to radius
-                radius = maxRadius * col / size;
-            }
-            polarMapX_.at<float>(row, col) = cx + radius * cosA;
-            polarMapY_.at<float>(row, col) = cy + radius * sinA;
-        }
-    }
+FFTRegistration::CorrelationWorkspace &FFTRegistration::workspace(cv::Size size)
+{
+    thread_local std::map<std::pair<int, int>, CorrelationWorkspace> workspaces;
+    return workspaces[{size.width, size.height}];
 }
 
-cv::Mat FFTRegistration::toPolar(const cv::Mat &mag, int size) const
+// Sub-pixel offset of a peak from the parabola through it and its two (wrapping) neighbours
+static double parabolic_offset(float prev, float peak, float next)
 {
-    cv::Mat polar;
-    cv::remap(mag, polar, polarMapX_, polarMapY_, cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0));
-    cv::normalize(polar, polar, 0, 1, cv::NORM_MINMAX);
-    return polar;
+    double d = (double)prev - 2.0 * peak + (double)next;
+    if (std::abs(d) <= 1e-12)
+        return 0.0;
+    return 0.5 * ((double)prev - (double)next) / d;
 }
 
-cv::Mat FFTRegistration::makeCPS(const cv::Mat &fftA, const cv::Mat &fftB)
+// Peak of the inverse DFT of a spectrum, located on a grid 1/factor pixel apart within one pixel of an integer
+// peak (unshifted coordinates). Instead of padding and transforming a larger array, the inverse DFT is evaluated
+// only on that grid, as two small matrix products (Guizar-Sicairos et al. 2008). The surface is real, so only
+// the non-redundant half of the spectrum is read and the other half is accounted for by doubling its weight.
+static cv::Point2d upsampled_peak(const cv::Mat &spectrum, cv::Size size, cv::Point peak, int factor)
 {
-    cv::Mat pa[2], pb[2];
-    cv::split(fftA, pa);
-    cv::split(fftB, pb);
+    const int n = 2 * factor + 1;
+    const int cols = size.width / 2 + 1;
+
+    // Column kernel: half-spectrum columns to grid x positions
+    cv::Mat kx(cols, n, CV_32FC2);
+    for (int k = 0; k < cols; ++k)
+    {
+        double weight = (k == 0 || 2 * k == size.width) ? 1.0 : 2.0;
+        auto *row = kx.ptr<cv::Vec2f>(k);
+        for (int j = 0; j < n; ++j)
+        {
+            double phase = 2.0 * CV_PI * k * (peak.x + (double)(j - factor) / factor) / size.width;
+            row[j] = cv::Vec2f(static_cast<float>(weight * std::cos(phase)),
+                               static_cast<float>(weight * std::sin(phase)));
+        }
+    }
+
+    // Row kernel: grid y positions to spectrum rows, with signed frequencies so the interpolation is band-limited
+    cv::Mat ky(n, size.height, CV_32FC2);
+    for (int i = 0; i < n; ++i)
+    {
+        double y = peak.y + (double)(i - factor) / factor;
+        auto *row = ky.ptr<cv::Vec2f>(i);
+        for (int k = 0; k < size.height; ++k)
+        {
+            int freq = k <= size.height / 2 ? k : k - size.height;
+            double phase = 2.0 * CV_PI * freq * y / size.height;
+            row[k] = cv::Vec2f(static_cast<float>(std::cos(phase)), static_cast<float>(std::sin(phase)));
+        }
+    }
 
-    // Numerator = A · conj(B)
-    cv::Mat re = pa[0].mul(pb[0]) + pa[1].mul(pb[1]);
-    cv::Mat im = pa[1].mul(pb[0]) - pa[0].mul(pb[1]);
+    cv::Mat partial, grid;
+    cv::gemm(spectrum.colRange(0, cols), kx, 1.0, cv::noArray(), 0.0, partial);
+    cv::gemm(ky, partial, 1.0, cv::noArray(), 0.0, grid);
 
-    cv::Mat den;
-    cv::magnitude(re, im, den);
-    den = cv::max(den, 1e-10f);
-    re /= den;
-    im /= den;
+    cv::Mat real;
+    cv::extractChannel(grid, real, 0);
+    cv::Point best;
+    cv::minMaxLoc(real, nullptr, nullptr, nullptr, &best);
 
-    cv::Mat cps;
-    cv::Mat ch[] = {re, im};
-    cv::merge(ch, 2, cps);
-    return cps;
+    return cv::Point2d(peak.x + (double)(best.x - factor) / factor, peak.y + (double)(best.y - factor) / factor);
 }
 
-double FFTRegistration::detectRotation(const cv::Mat &targetImg) const
+cv::Point2d FFTRegistration::correlate(const CorrelationPlan &plan, const cv::Mat &target, CorrelationPeak *peak) const
 {
-    cv::Mat tgtPrep = preprocess(targetImg);
-    cv::Mat tgtMag = computeMagnitudeSpectrum(tgtPrep, polarSize_);
-    cv::Mat tgtPol = toPolar(tgtMag, polarSize_);
+    // Same steps as cv::phaseCorrelate, minus the reference transform and window that the plan already holds
+    CorrelationWorkspace &ws = workspace(plan.size);
+
+    cv::Rect overlap(0, 0, std::min(target.cols, plan.size.width), std::min(target.rows, plan.size.height));
+    ws.padded.create(plan.size, CV_32F);
+    ws.padded.setTo(0);
+    cv::multiply(target(overlap), plan.window(overlap), ws.padded(overlap));
+
+    fft_->forward(ws.padded, ws.spectrum);
+    crossPowerSpectrum(plan.refFFT, ws.spectrum);
+    if (upsample_ > 0)
+        ws.spectrum.copyTo(ws.crossPower);
+
+    fft_->inverse(ws.spectrum, ws.surface, plan.size);
+    fftShift(ws.surface);
+    return locatePeak(ws.surface, ws.crossPower, peak);
+}
 
-    // DFT of target polar image
-    cv::Mat planes[] = {tgtPol, cv::Mat::zeros(tgtPol.size(), CV_32F)};
-    cv::Mat c1;
-    cv::merge(planes, 2, c1);
-    cv::dft(c1, c1);
-
-    // Cross-power spectrum → inverse DFT → peak
-    cv::Mat cps = makeCPS(refPolarFFT_, c1);
-    cv::Mat inv;
-    cv::idft(cps, inv, cv::DFT_SCALE);
-    cv::split(inv, planes);
-    cv::Mat R;
-    cv::magnitude(planes[0], planes[1], R);
+// Shift that aligns the target, from the peak of an fftShift-ed correlation surface. crossPower is only read
+// when upsampling.
+cv::Point2d FFTRegistration::locatePeak(const cv::Mat &C, const cv::Mat &crossPower, CorrelationPeak *peak) const
+{
+    cv::Point peakLoc;
+    cv::minMaxLoc(C, nullptr, nullptr, nullptr, &peakLoc);
+
+    // Weighted centroid over a 5x5 box around the peak
+    int minr = std::max(peakLoc.y - 2, 0), maxr = std::min(peakLoc.y + 2, C.rows - 1);
+    int minc = std::max(peakLoc.x - 2, 0), maxc = std::min(peakLoc.x + 2, C.cols - 1);
+    double sx = 0.0, sy = 0.0, sum = 0.0;
+    for (int y = minr; y <= maxr; ++y)
+    {
+        const float *row = C.ptr<float>(y);
+        for (int x = minc; x <= maxc; ++x)
+        {
+            sx += (double)x * row[x];
+            sy += (double)y * row[x];
+            sum += row[x];
+        }
+    }
+
+    if (peak)
+    {
+        peak->response = sum / C.total();
+        peak->psr = peakToSidelobe(C, peakLoc);
+    }
+
+    cv::Point2d center(C.cols / 2.0, C.rows / 2.0);
+    if (upsample_ > 0)
+    {
+        // The upsampled DFT works on the unshifted surface, whose peak sits at minus the shift
+        cv::Point unshifted(peakLoc.x - C.cols / 2, peakLoc.y - C.rows / 2);
+        return -upsampled_peak(crossPower, C.size(), unshifted, upsample_);
+    }
+
+    sum += DBL_EPSILON;
+    return center - cv::Point2d(sx / sum, sy / sum);
+}
+
+double FFTRegistration::peakToSidelobe(const cv::Mat &surface, cv::Point peak)
+{
+    // Mean and deviation of the surface outside a small box around the peak, from whole-surface
+    // sums minus the box
+    double sum = 0.0, sumSq = 0.0;
+    for (int r = 0; r < surface.rows; ++r)
+    {
+        const float *row = surface.ptr<float>(r);
+        for (int c = 0; c < surface.cols; ++c)
+        {
+            sum += row[c];
+            sumSq += (double)row[c] * row[c];
+        }
+    }
+
+    cv::Rect box = cv::Rect(peak.x - kSidelobeExclusion, peak.y - kSidelobeExclusion, 2 * kSidelobeExclusion + 1,
+                            2 * kSidelobeExclusion + 1) &
+                   cv::Rect(0, 0, surface.cols, surface.rows);
+    for (int r = box.y; r < box.y + box.height; ++r)
+    {
+        const float *row = surface.ptr<float>(r);
+        for (int c = box.x; c < box.x + box.width; ++c)
+        {
+            sum -= row[c];
+            sumSq -= (double)row[c] * row[c];
+        }
+    }
+
+    double n = (double)surface.total() - box.area();
+    if (n < 2)
+        return 0.0;
+    double mean = sum / n;
+    double sd = std::sqrt(std::max(sumSq / n - mean * mean, 0.0));
+    return (surface.at<float>(peak) - mean) / (sd + DBL_EPSILON);
+}
+
+void FFTRegistration::buildPolarRemapTables(PolarReference &polar, int angles, int radii) const
+{
+    polar.mapX = cv::Mat(angles, radii, CV_32F);
+    polar.mapY = cv::Mat(angles, radii, CV_32F);
+
+    float cx = polar.size / 2.f;
+    float cy = polar.size / 2.f;
+    float maxRadius = polar.size / 2.f;
+
+    // The radius depends on the column only, so the tables cost one multiply-add per entry and are rebuilt rather
+    // than cached
+    std::vector<float> radius(radii);
+    for (int col = 0; col < radii; ++col)
+    {
+        if (enableScaling)
+        {
+            // Log-polar: col maps logarithmically to radius
+            radius[col] = std::exp(static_cast<float>(col) * std::log(maxRadius) / radii);
+        }
+        else
+        {
+            // Linear polar: col maps linearly to radius
+            radius[col] = maxRadius * col / radii;
+        }
+    }
+
+    for (int row = 0; row < angles; ++row)
+    {
+        // angle ∈ [0, π)  mapped linearly over rows — matches PixInsight's
+        // polarTransform(0, Math.PI).
+        float angle = static_cast<float>(CV_PI) * row / angles;
+        float cosA = std::cos(angle);
+        float sinA = std::sin(angle);
+
+        float *mx = polar.mapX.ptr<float>(row);
+        float *my = polar.mapY.ptr<float>(row);
+        for (int col = 0; col < radii; ++col)
+        {
+            mx[col] = cx + radius[col] * cosA;
+            my[col] = cy + radius[col] * sinA;
+        }
+    }
+}
+
+cv::Mat FFTRegistration::toPolar(const cv::Mat &mag, const PolarReference &polar)
+{
+    cv::Mat pol;
+    cv::remap(mag, pol, polar.mapX, polar.mapY, cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0));
+    cv::normalize(pol, pol, 0, 1, cv::NORM_MINMAX);
+    return pol;
+}
+
+// Window and spectrum size for a rotation reference, plus the remap tables and reference spectrum unless the
+// cache already provided them. The polar grid defaults to the spectrum size; a coarser one makes the polar
+// correlation much cheaper.
+void FFTRegistration::preparePolar(PolarReference &polar, const cv::Mat &rotRef, int angles, int radii) const
+{
+    polar.size = cv::getOptimalDFTSize(std::max(rotRef.cols, rotRef.rows));
+    cv::createHanningWindow(polar.window, cv::Size(polar.size, polar.size), CV_32F);
+
+    buildPolarRemapTables(polar, angles > 0 ? angles : polar.size, radii > 0 ? radii : polar.size);
+    fft_->plan(polar.mapX.size());
+
+    // A spectrum loaded from the cache is kept if it matches the grid
+    if (polar.refFFT.rows != polar.mapX.rows || polar.refFFT.cols > polar.mapX.cols)
+    {
+        cv::Mat pol = toPolar(computeMagnitudeSpectrum(rotRef, polar), polar);
+        fft_->forward(pol, polar.refFFT);
+    }
+}
+
+void FFTRegistration::crossPowerSpectrum(const cv::Mat &fftA, cv::Mat &fftB)
+{
+    // fftB = A · conj(B) / |A · conj(B)|, computed in place in a single pass
+    for (int r = 0; r < fftB.rows; ++r)
+    {
+        const float *a = fftA.ptr<float>(r);
+        float *b = fftB.ptr<float>(r);
+        for (int c = 0; c < 2 * fftB.cols; c += 2)
+        {
+            float re = a[c] * b[c] + a[c + 1] * b[c + 1];
+            float im = a[c + 1] * b[c] - a[c] * b[c + 1];
+            float inv = 1.0f / std::max(std::sqrt(re * re + im * im), 1e-10f);
+            b[c] = re * inv;
+            b[c + 1] = im * inv;
+        }
+    }
+}
+
+
+FFTRegistration::RotationScale FFTRegistration::detectRotationScale(const cv::Mat &tgtPrep,
+                                                                    const PolarReference &polar) const
+{
+    cv::Mat tgtMag = computeMagnitudeSpectrum(tgtPrep, polar);
+    cv::Mat tgtPol = toPolar(tgtMag, polar);
+
+    // DFT of target polar image
+    cv::Mat c1;
+    fft_->forward(tgtPol, c1);
+
+    // Cross-power spectrum → inverse DFT → peak.  Both inputs are real,
+    // so the correlation surface is real as well.
+    crossPowerSpectrum(polar.refFFT, c1);
+    cv::Mat crossPower;
+    if (upsample_ > 0)
+        c1.copyTo(crossPower);
+    cv::Mat R;
+    fft_->inverse(c1, R, tgtPol.size(), true);
     cv::normalize(R, R, 0, 1, cv::NORM_MINMAX);
 
-    // Parabolic sub-pixel along Y (angle) axis
+    // Parabolic sub-pixel on both axes: Y is the angle, X the log radius
     cv::Point maxLoc;
     cv::minMaxLoc(R, nullptr, nullptr, nullptr, &maxLoc);
-    int py = maxLoc.y;
-    int h = R.rows;
+    int px = maxLoc.x, py = maxLoc.y;
+    int w = R.cols, h = R.rows;
 
-    float yp = R.at<float>((py - 1 + h) % h, maxLoc.x);
-    float y0 = R.at<float>(py, maxLoc.x);
-    float yn = R.at<float>((py + 1) % h, maxLoc.x);
+    RotationScale rs;
+    rs.psr = peakToSidelobe(R, maxLoc);
 
-    double subY = py;
-    double d = (double)yp - 2.0 * y0 + (double)yn;
-    if (std::abs(d) > 1e-12)
-        subY += 0.5 * ((double)yp - (double)yn) / d;
+    cv::Point2d sub = upsample_ > 0 ? upsampled_peak(crossPower, R.size(), maxLoc, upsample_) : cv::Point2d();
+    double subY = upsample_ > 0 ? sub.y
+                                : py + parabolic_offset(R.at<float>((py - 1 + h) % h, px), R.at<float>(py, px),
+                                                        R.at<float>((py + 1) % h, px));
 
     // Y → angle: rows map to [0°, 180°)
     double angle = 180.0 * subY / h;
@@ -307,94 +1140,786 @@ double FFTRegistration::detectRotation(const cv::Mat &targetImg) const
     if (angle > 90.0)
         angle -= 180.0; // e.g. 170° → −10°
     // else: small positive angle stays positive
+    rs.angleDeg = angle;
+
+    if (enableScaling)
+    {
+        // X → scale: a target enlarged by a has its spectrum shrunk by a, which moves the log-polar
+        // image by ln(a) / (ln(maxRadius) / size) columns. The correction is the inverse factor.
+        double subX = upsample_ > 0
+                          ? sub.x
+                          : px + parabolic_offset(R.at<float>(py, (px - 1 + w) % w), R.at<float>(py, px),
+                                                  R.at<float>(py, (px + 1) % w));
+        if (subX > w / 2.0)
+            subX -= w;
+
+        double logStep = std::log(polar.size / 2.0) / w;
+        rs.scale = std::exp(-subX * logStep);
+    }
+
+    return rs;
+}
+
+static constexpr std::string_view kCacheMagic = "LUNALIGN-REFCACHE 1";
+
+// Version of the cached computation, part of the key. Bump it with any change to preprocess, the polar
+// transform or the cached data, so files written by older builds are recomputed instead of loaded.
+static constexpr int kCacheVersion = 3;
+
+// FNV-1a over the reference pixels, followed by every option the cached state depends on. The hash names the
+// file, the full key stored inside it guards against collisions and stale files.
+static std::string reference_cache_key(const cv::Mat &ref, const RegistrationOptions &options, std::string_view fft)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (int r = 0; r < ref.rows; ++r)
+    {
+        const uint8_t *row = ref.ptr<uint8_t>(r);
+        for (size_t i = 0; i < ref.cols * ref.elemSize(); ++i)
+        {
+            hash ^= row[i];
+            hash *= 1099511628211ull;
+        }
+    }
 
-    // std::printf("  [rot detect] peak=(%d,%d)  subY=%.2f  angle=%+.3f°\n",
-    //             maxLoc.x, maxLoc.y, subY, angle);
+    return std::format("{:016x} {}x{}x{} rot={} scale={} highpass={} pyramid={} roi={},{},{},{} auto={} "
+                       "polar={}x{} fft={} version={}",
+                       hash, ref.cols, ref.rows, ref.type(), options.enableRotation, options.enableScaling,
+                       options.useHighpass, options.pyramid, options.roi.x, options.roi.y, options.roi.width,
+                       options.roi.height, options.autoRoi, options.polarAngles, options.polarRadii, fft,
+                       kCacheVersion);
+}
 
-    return angle;
+static void write_mat(std::ofstream &out, const cv::Mat &m)
+{
+    int32_t header[3] = {m.rows, m.cols, m.type()};
+    out.write(reinterpret_cast<const char *>(header), sizeof(header));
+    for (int r = 0; r < m.rows; ++r)
+        out.write(reinterpret_cast<const char *>(m.ptr(r)), m.cols * m.elemSize());
+}
+
+// Rejects a stored matrix of another type or larger than maxSize before allocating it, so a damaged or foreign
+// file can neither crash the load nor make it allocate arbitrary amounts of memory
+static bool read_mat(std::ifstream &in, cv::Mat &m, int type, cv::Size maxSize)
+{
+    int32_t header[3];
+    if (!in.read(reinterpret_cast<char *>(header), sizeof(header)) || header[0] < 0 || header[1] < 0 ||
+        header[0] > maxSize.height || header[1] > maxSize.width)
+        return false;
+    // State that was not computed is stored empty, with the type of a default cv::Mat
+    if (header[0] == 0 || header[1] == 0)
+    {
+        m.release();
+        return true;
+    }
+    if (header[2] != type)
+        return false;
+    m.create(header[0], header[1], type);
+    return static_cast<bool>(in.read(reinterpret_cast<char *>(m.data), m.total() * m.elemSize()));
 }
 
-FFTRegistration::FFTRegistration(const cv::Mat &referenceImage, bool enableRotation, bool enableScaling,
-                                 bool useHighpass)
-    : enableRotation{enableRotation}, enableScaling{enableScaling}, useHighpass{useHighpass}
+FFTRegistration::FFTRegistration(const cv::Mat &referenceImage, const RegistrationOptions &options)
+    : enableRotation{options.enableRotation}, enableScaling{options.enableScaling}, useHighpass{options.useHighpass},
+      fft_{options.fft ? options.fft : FFTBackend::create("opencv")}, pyramid_{std::max(options.pyramid, 1)},
+      tolerance_{options.tolerance}, interpolation_{options.interpolation}, windowMinPsr_{options.trackingMinPsr},
+      upsample_{std::max(options.upsample, 0)}
 {
     refW_ = referenceImage.cols;
     refH_ = referenceImage.rows;
-    refPrep_ = preprocess(referenceImage);
 
-    if (enableRotation)
+    std::string cacheKey, cachePath;
+    if (!options.cacheDir.empty())
+    {
+        cacheKey = reference_cache_key(referenceImage, options, fft_->name());
+        cachePath = (fs::path(options.cacheDir) / ("ref-" + cacheKey.substr(0, 16) + ".bin")).string();
+        int polarMax = std::max({cv::getOptimalDFTSize(std::max(refW_, refH_)), options.polarAngles,
+                                 options.polarRadii});
+        fromCache_ = loadReferenceCache(cachePath, cacheKey, polarMax);
+    }
+    if (!fromCache_)
+        refPrep_ = preprocess(referenceImage);
+
+    // Everything on the reference side of the correlation is computed once here
+    transPlan_ = makePlan(refPrep_);
+
+    // The correlation window is either the requested ROI, the most detailed part of the reference, or for the
+    // pyramid the middle of the frame. The margin around it lets the highpass blur see the same neighbourhood
+    // as on a full frame.
+    bool searchesPrior = options.tracking || options.engine == RegistrationEngine::Hybrid;
+    int winW = std::min(kRegistrationWindowSize, refW_ - 2 * kWindowMargin);
+    int winH = std::min(kRegistrationWindowSize, refH_ - 2 * kWindowMargin);
+    bool hasWindow = false;
+    if (!options.roi.empty())
+    {
+        windowRect_ = options.roi & cv::Rect(0, 0, refW_, refH_);
+        hasWindow = !windowRect_.empty();
+    }
+    else if ((options.autoRoi || pyramid_ > 1 || searchesPrior) && std::min(winW, winH) >= kMinWindowSize)
+    {
+        if (!fromCache_ || windowRect_.empty())
+            windowRect_ = options.autoRoi ? selectFeatureWindow(refPrep_, cv::Size(winW, winH))
+                                          : cv::Rect((refW_ - winW) / 2, (refH_ - winH) / 2, winW, winH);
+        hasWindow = true;
+    }
+
+    // The preprocessed window and coarse reference may come from the cache, their plans are one FFT each and
+    // always rebuilt
+    if (hasWindow)
+    {
+        if (windowPrep_.size() != windowRect_.size())
+            windowPrep_ = extractWindow(referenceImage, cv::Point(0, 0), 0.0, 1.0);
+        windowPlan_ = makePlan(windowPrep_);
+    }
+    else
+    {
+        windowPrep_.release();
+    }
+
+    // Tracking alone keeps the full-frame search for frames without a prediction
+    windowed_ = hasWindow && (!options.roi.empty() || options.autoRoi || pyramid_ > 1);
+    tracking_ = hasWindow && searchesPrior;
+
+    if (pyramid_ > 1 && windowed_)
+    {
+        if (coarsePrep_.empty())
+        {
+            cv::Mat refSmall;
+            cv::resize(referenceImage, refSmall, cv::Size(), 1.0 / pyramid_, 1.0 / pyramid_, cv::INTER_AREA);
+            coarsePrep_ = preprocess(refSmall, pyramid_);
+        }
+        coarsePlan_ = makePlan(coarsePrep_);
+    }
+    else
+    {
+        pyramid_ = 1;
+        coarsePrep_.release();
+    }
+
+    if (usesPolar())
+    {
+        // Rotation does not depend on scale or position, so the pyramid detects it on the coarse pair
+        // and ROI registration on the window
+        const cv::Mat &rotRef = pyramid_ > 1 ? coarsePrep_ : windowed_ ? windowPrep_ : refPrep_;
+        preparePolar(polar_, rotRef, options.polarAngles, options.polarRadii);
+
+        // The coarse estimate is refined on the full-resolution window
+        if (pyramid_ > 1)
+            preparePolar(windowPolar_, windowPrep_, options.polarAngles, options.polarRadii);
+    }
+
+    if (!cachePath.empty() && !fromCache_)
+        saveReferenceCache(cachePath, cacheKey);
+
+    if (options.apSize > 0)
+        placeAlignmentPoints(options.apSize, options.apContrast);
+}
+
+// Loads everything the constructor derives from the reference pixels and is worth storing: the preprocessed frame,
+// window and coarse reference, the window position and both polar spectra. Plans and remap tables are rebuilt.
+// Nothing is kept unless the whole file reads back with the expected types and sizes.
+bool FFTRegistration::loadReferenceCache(const std::string &path, const std::string &key, int polarMax)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::string magic, storedKey;
+    if (!in || !std::getline(in, magic) || magic != kCacheMagic || !std::getline(in, storedKey) || storedKey != key)
+        return false;
+
+    cv::Size refSize(refW_, refH_), polarSize(polarMax, polarMax);
+    cv::Mat prep, rect, windowPrep, coarsePrep, polarFFT, windowPolarFFT;
+    if (!read_mat(in, prep, CV_32F, refSize) || !read_mat(in, rect, CV_32S, cv::Size(1, 4)) ||
+        !read_mat(in, windowPrep, CV_32F, refSize) || !read_mat(in, coarsePrep, CV_32F, refSize) ||
+        !read_mat(in, polarFFT, CV_32FC2, polarSize) || !read_mat(in, windowPolarFFT, CV_32FC2, polarSize))
+        return false;
+
+    cv::Rect window;
+    if (!rect.empty())
+        window = cv::Rect(rect.at<int>(0), rect.at<int>(1), rect.at<int>(2), rect.at<int>(3));
+    if (prep.size() != refSize || (window & cv::Rect(cv::Point(), refSize)) != window ||
+        (!windowPrep.empty() && windowPrep.size() != window.size()))
+        return false;
+
+    refPrep_ = prep;
+    windowRect_ = window;
+    windowPrep_ = windowPrep;
+    coarsePrep_ = coarsePrep;
+    polar_.refFFT = polarFFT;
+    windowPolar_.refFFT = windowPolarFFT;
+    return true;
+}
+
+// A failed write only costs the next run the setup again, so errors are ignored
+void FFTRegistration::saveReferenceCache(const std::string &path, const std::string &key) const
+{
+    std::error_code ec;
+    fs::create_directories(fs::path(path).parent_path(), ec);
+
+    // Written under a temporary name and renamed, so an interrupted run never leaves a truncated cache behind
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return;
+        out << kCacheMagic << '\n' << key << '\n';
+        write_mat(out, refPrep_);
+        cv::Vec4i rect(windowRect_.x, windowRect_.y, windowRect_.width, windowRect_.height);
+        write_mat(out, windowRect_.empty() ? cv::Mat() : cv::Mat(rect));
+        write_mat(out, windowPrep_);
+        write_mat(out, coarsePrep_);
+        write_mat(out, polar_.refFFT);
+        write_mat(out, windowPolar_.refFFT);
+        if (!out)
+            return;
+    }
+    fs::rename(tmp, path, ec);
+}
+
+// Zero-padded copy of the size x size tile at origin
+static void copy_tile(const cv::Mat &src, cv::Point origin, int size, cv::Mat &tile)
+{
+    tile.create(size, size, CV_32F);
+    tile.setTo(0);
+    cv::Rect from = cv::Rect(origin.x, origin.y, size, size) & cv::Rect(0, 0, src.cols, src.rows);
+    if (!from.empty())
+        src(from).copyTo(tile(cv::Rect(from.x - origin.x, from.y - origin.y, from.width, from.height)));
+}
+
+void FFTRegistration::placeAlignmentPoints(int size, double minContrast)
+{
+    if (size < kMinApSize || refW_ < size || refH_ < size)
+        return;
+
+    apSize_ = size;
+    apStep_ = size / 2;
+    apGrid_ = cv::Size((refW_ - size) / apStep_ + 1, (refH_ - size) / apStep_ + 1);
+    apOrigin_ = cv::Point((refW_ - size - (apGrid_.width - 1) * apStep_) / 2,
+                          (refH_ - size - (apGrid_.height - 1) * apStep_) / 2);
+
+    // Tile contrast is the standard deviation of the preprocessed reference; flat sky and featureless maria
+    // give no usable peak
+    cv::Mat contrast(apGrid_, CV_64F);
+    for (int gy = 0; gy < apGrid_.height; ++gy)
+    {
+        for (int gx = 0; gx < apGrid_.width; ++gx)
+        {
+            cv::Rect tile(apOrigin_.x + gx * apStep_, apOrigin_.y + gy * apStep_, size, size);
+            cv::Scalar mean, sd;
+            cv::meanStdDev(refPrep_(tile), mean, sd);
+            contrast.at<double>(gy, gx) = sd[0];
+        }
+    }
+    double maxContrast;
+    cv::minMaxLoc(contrast, nullptr, &maxContrast);
+
+    cv::createHanningWindow(apWindow_, cv::Size(size, size), CV_32F);
+    for (int gy = 0; gy < apGrid_.height; ++gy)
+    {
+        for (int gx = 0; gx < apGrid_.width; ++gx)
+        {
+            if (contrast.at<double>(gy, gx) >= minContrast * maxContrast)
+                apCells_.emplace_back(gx, gy);
+        }
+    }
+
+    if (apCells_.empty())
+        return;
+
+    // Frames transform their tiles in batches of kApBatchSize plus one remainder batch, planned here once
+    const int count = static_cast<int>(apCells_.size());
+    fft_->plan(cv::Size(size, size), std::min(kApBatchSize, count));
+    if (count > kApBatchSize && count % kApBatchSize != 0)
+        fft_->plan(cv::Size(size, size), count % kApBatchSize);
+
+    apRefFFT_.reserve(count);
+    for (int first = 0; first < count; first += kApBatchSize)
     {
-        polarSize_ = cv::getOptimalDFTSize(std::max(refW_, refH_));
+        // Fresh buffers per batch: a backend may write into the spectra it is given, and these are kept
+        std::vector<cv::Mat> tiles, spectra;
+        for (int k = first; k < std::min(first + kApBatchSize, count); ++k)
+        {
+            cv::Point origin = apOrigin_ + apCells_[k] * apStep_;
+            tiles.push_back(refPrep_(cv::Rect(origin.x, origin.y, size, size)).mul(apWindow_));
+        }
+        fft_->forwardBatch(tiles, spectra);
+        apRefFFT_.insert(apRefFFT_.end(), spectra.begin(), spectra.end());
+    }
+}
+
+FFTRegistration::ApWorkspace &FFTRegistration::apWorkspace()
+{
+    thread_local ApWorkspace ws;
+    return ws;
+}
+
+void FFTRegistration::measureLocalShifts(const cv::Mat &targetImage, RegistrationResult &res,
+                                         const cv::Mat &preprocessed) const
+{
+    if (apCells_.empty())
+        return;
+
+    // Tiles come from the target derotated like the translation measurement, at the whole-pixel global shift;
+    // what each tile measures beyond the global shift is the local residual
+    cv::Mat prep = derotate(preprocessed.empty() ? preprocess(targetImage) : preprocessed, res.rotationAngleDeg,
+                            res.scalingRatio);
+    cv::Point offset(cvRound(res.dx), cvRound(res.dy));
+    cv::Point2d residual = cv::Point2d(offset) - cv::Point2d(res.dx, res.dy);
+
+    res.localShifts = cv::Mat(apGrid_, CV_32FC2, cv::Scalar::all(std::numeric_limits<float>::quiet_NaN()));
+
+    // Tiles are transformed kApBatchSize at a time, so the scratch memory does not grow with the point count
+    const int count = static_cast<int>(apCells_.size());
+    const int batches = (count + kApBatchSize - 1) / kApBatchSize;
+    const cv::Size size(apSize_, apSize_);
+
+#ifdef LUNALIGN_USE_OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int b = 0; b < batches; ++b)
+    {
+        ApWorkspace &ws = apWorkspace();
+        const int first = b * kApBatchSize;
+        const int n = std::min(kApBatchSize, count - first);
+
+        ws.tiles.resize(n);
+        for (int k = 0; k < n; ++k)
+        {
+            cv::Point origin = apOrigin_ + apCells_[first + k] * apStep_ + offset;
+            copy_tile(prep, origin, apSize_, ws.tiles[k]);
+            cv::multiply(ws.tiles[k], apWindow_, ws.tiles[k]);
+        }
+
+        fft_->forwardBatch(ws.tiles, ws.spectra);
+        ws.crossPowers.resize(n);
+        for (int k = 0; k < n; ++k)
+        {
+            crossPowerSpectrum(apRefFFT_[first + k], ws.spectra[k]);
+            if (upsample_ > 0)
+                ws.spectra[k].copyTo(ws.crossPowers[k]);
+        }
+        fft_->inverseBatch(ws.spectra, ws.surfaces, size);
+
+        for (int k = 0; k < n; ++k)
+        {
+            cv::Mat &surface = ws.surfaces[k];
+            fftShift(surface);
+
+            CorrelationPeak peak;
+            cv::Point2d shift = locatePeak(surface, upsample_ > 0 ? ws.crossPowers[k] : cv::Mat(), &peak);
+
+            // A tile that moved by more than a quarter of its size has lost too much overlap to be trusted
+            if (peak.psr < kMinApPsr || cv::norm(shift) > apSize_ / 4.0)
+                continue;
+            cv::Point2d local = shift + residual;
+            res.localShifts.at<cv::Vec2f>(apCells_[first + k]) =
+                cv::Vec2f(static_cast<float>(local.x), static_cast<float>(local.y));
+        }
+    }
+}
+
+// Per-pixel local shift in reference coordinates. Rejected points are filled from their neighbours by normalised
+// convolution, which also smooths the grid, and the grid is interpolated bicubically between the tile centres.
+cv::Mat FFTRegistration::displacementField(const cv::Mat &localShifts) const
+{
+    cv::Mat values(localShifts.size(), CV_32FC2, cv::Scalar::all(0));
+    cv::Mat weights(localShifts.size(), CV_32F, cv::Scalar(0));
+    for (int gy = 0; gy < localShifts.rows; ++gy)
+    {
+        for (int gx = 0; gx < localShifts.cols; ++gx)
+        {
+            cv::Vec2f v = localShifts.at<cv::Vec2f>(gy, gx);
+            if (std::isnan(v[0]))
+                continue;
+            values.at<cv::Vec2f>(gy, gx) = v;
+            weights.at<float>(gy, gx) = 1.f;
+        }
+    }
+
+    cv::GaussianBlur(values, values, cv::Size(5, 5), 1.0, 1.0, cv::BORDER_REPLICATE);
+    cv::GaussianBlur(weights, weights, cv::Size(5, 5), 1.0, 1.0, cv::BORDER_REPLICATE);
+    for (int gy = 0; gy < values.rows; ++gy)
+    {
+        for (int gx = 0; gx < values.cols; ++gx)
+        {
+            float w = weights.at<float>(gy, gx);
+            values.at<cv::Vec2f>(gy, gx) = w > 1e-3f ? values.at<cv::Vec2f>(gy, gx) / w : cv::Vec2f(0, 0);
+        }
+    }
+
+    // Reference pixel -> grid coordinates, with grid cell (0, 0) at the centre of the first tile
+    double cx = apOrigin_.x + apSize_ / 2.0, cy = apOrigin_.y + apSize_ / 2.0;
+    cv::Mat A = (cv::Mat_<double>(2, 3) << 1.0 / apStep_, 0, -cx / apStep_, 0, 1.0 / apStep_, -cy / apStep_);
+    cv::Mat field;
+    cv::warpAffine(values, field, A, cv::Size(refW_, refH_), cv::INTER_CUBIC | cv::WARP_INVERSE_MAP,
+                   cv::BORDER_REPLICATE);
+    return field;
+}
+
+bool FFTRegistration::isTranslation(double angleDeg, double scale)
+{
+    return std::abs(angleDeg) <= 0.01 && std::abs(scale - 1.0) <= 1e-4;
+}
+
+cv::Mat FFTRegistration::derotate(const cv::Mat &prep, double angleDeg, double scale)
+{
+    if (isTranslation(angleDeg, scale))
+        return prep;
+
+    cv::Point2f ctr(prep.cols / 2.f, prep.rows / 2.f);
+    cv::Mat M = cv::getRotationMatrix2D(ctr, -angleDeg, scale);
+    cv::Mat rotated;
+    cv::warpAffine(prep, rotated, M, prep.size(), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+    return rotated;
+}
+
+cv::Rect FFTRegistration::selectFeatureWindow(const cv::Mat &prep, cv::Size size)
+{
+    // Local variance over every window position, from box-filtered first and second moments
+    cv::Mat mean, sqMean;
+    cv::boxFilter(prep, mean, CV_32F, size, cv::Point(-1, -1), true, cv::BORDER_REFLECT);
+    cv::boxFilter(prep.mul(prep), sqMean, CV_32F, size, cv::Point(-1, -1), true, cv::BORDER_REFLECT);
+    cv::Mat variance = sqMean - mean.mul(mean);
+
+    // Only centres whose window lies entirely inside the frame
+    cv::Rect centres(size.width / 2, size.height / 2, prep.cols - size.width + 1, prep.rows - size.height + 1);
+    cv::Point best;
+    cv::minMaxLoc(variance(centres), nullptr, nullptr, nullptr, &best);
+
+    return cv::Rect(best.x, best.y, size.width, size.height);
+}
+
+cv::Mat FFTRegistration::extractWindow(const cv::Mat &image, cv::Point2d offset, double angleDeg,
+                                       double scale) const
+{
+    // Source coordinates of the refinement window plus margin, after derotating and rescaling the image
+    // about its centre and shifting by the predicted offset
+    cv::Rect outer(windowRect_.x - kWindowMargin, windowRect_.y - kWindowMargin,
+                   windowRect_.width + 2 * kWindowMargin, windowRect_.height + 2 * kWindowMargin);
+
+    cv::Point2f ctr(image.cols / 2.f, image.rows / 2.f);
+    cv::Mat Minv;
+    cv::invertAffineTransform(cv::getRotationMatrix2D(ctr, -angleDeg, scale), Minv);
+
+    double tx = outer.x + offset.x, ty = outer.y + offset.y;
+    cv::Mat W = Minv.clone();
+    W.at<double>(0, 2) += Minv.at<double>(0, 0) * tx + Minv.at<double>(0, 1) * ty;
+    W.at<double>(1, 2) += Minv.at<double>(1, 0) * tx + Minv.at<double>(1, 1) * ty;
+
+    cv::Mat crop;
+    // Bicubic keeps the phase of a fractional offset closer to a true shift than bilinear, which refineShift
+    // relies on when it correlates what is left after resampling at its estimate
+    cv::warpAffine(image, crop, W, outer.size(), cv::INTER_CUBIC | cv::WARP_INVERSE_MAP, cv::BORDER_REPLICATE);
+
+    cv::Mat prep = preprocess(crop);
+    return prep(cv::Rect(kWindowMargin, kWindowMargin, windowRect_.width, windowRect_.height));
+}
+
+std::optional<cv::Point2d> FFTRegistration::refineShift(const cv::Mat &targetImage, cv::Point2d predicted,
+                                                        double angleDeg, double scale,
+                                                        CorrelationPeak *peak) const
+{
+    // Resample the window at the current estimate, fractional part included, and correlate what is left. The
+    // estimate is accepted once that residual is at most tolerance_: the window shifted by the result then matches
+    // the reference window to within the tolerance. Estimates that keep moving fall back to the full frame.
+    for (int iter = 0; iter < kMaxRefineIterations; ++iter)
+    {
+        cv::Mat window = extractWindow(targetImage, predicted, angleDeg, scale);
+        cv::Point2d residual = correlate(windowPlan_, window, peak);
+        predicted += residual;
+
+        if (cv::norm(residual) <= tolerance_)
+            return predicted;
+    }
+    return std::nullopt;
+}
+
+void FFTRegistration::applyRotationScale(RegistrationResult &res, const RotationScale &rs) const
+{
+    // Scaling alone still needs the log-polar correlation, but leaves the rotation uncorrected
+    res.rotationAngleDeg = enableRotation ? rs.angleDeg : 0.0;
+    res.scalingRatio = rs.scale;
+    res.rotationPsr = rs.psr;
+    res.rotationMeasured = true;
+}
+
+RegistrationResult FFTRegistration::measureRotationScale(const cv::Mat &targetImage) const
+{
+    // Same input evaluate would measure rotation on
+    RegistrationResult res;
+    if (!usesPolar())
+        return res;
+
+    if (pyramid_ > 1)
+    {
+        coarseEstimate(targetImage, true, res);
+    }
+    else if (windowed_)
+    {
+        applyRotationScale(res, detectRotationScale(extractWindow(targetImage, cv::Point(0, 0), 0.0, 1.0), polar_));
+    }
+    else
+    {
+        applyRotationScale(res, detectRotationScale(preprocess(targetImage), polar_));
+    }
+    return res;
+}
+
+// Pyramid: shift, and unless fixed rotation and scale, from the downsampled pair. Rotation and scale are then
+// measured again on the full-resolution window at the predicted shift, and that result replaces the coarse one
+// when its peak is clear enough. Returns the predicted shift in full-resolution pixels.
+cv::Point2d FFTRegistration::coarseEstimate(const cv::Mat &targetImage, bool measurePolar,
+                                            RegistrationResult &res) const
+{
+    cv::Mat tgtSmall;
+    cv::resize(targetImage, tgtSmall, cv::Size(), 1.0 / pyramid_, 1.0 / pyramid_, cv::INTER_AREA);
+    cv::Mat tgtCoarse = preprocess(tgtSmall, pyramid_);
 
-        // Build the remap tables once (reused for every target)
-        buildPolarRemapTables(polarSize_);
+    if (measurePolar)
+        applyRotationScale(res, detectRotationScale(tgtCoarse, polar_));
 
-        cv::Mat mag = computeMagnitudeSpectrum(refPrep_, polarSize_);
-        cv::Mat pol = toPolar(mag, polarSize_);
+    cv::Mat tgtForTrans = derotate(tgtCoarse, res.rotationAngleDeg, res.scalingRatio);
+    cv::Point2d predicted = correlate(coarsePlan_, tgtForTrans) * pyramid_;
 
-        cv::Mat planes[] = {pol, cv::Mat::zeros(pol.size(), CV_32F)};
-        cv::merge(planes, 2, refPolarFFT_);
-        cv::dft(refPolarFFT_, refPolarFFT_);
+    if (measurePolar)
+    {
+        cv::Point offset(cvRound(predicted.x), cvRound(predicted.y));
+        RotationScale fine = detectRotationScale(extractWindow(targetImage, offset, 0.0, 1.0), windowPolar_);
+        if (fine.psr >= windowMinPsr_)
+            applyRotationScale(res, fine);
     }
+    return predicted;
 }
 
 RegistrationResult FFTRegistration::evaluate(const cv::Mat &targetImage) const
+{
+    return evaluate(targetImage, RegistrationPrior{});
+}
+
+RegistrationResult FFTRegistration::evaluate(const cv::Mat &targetImage, const RegistrationPrior &prior,
+                                             cv::Mat *preprocessed) const
 {
     RegistrationResult res;
+    CorrelationPeak peak;
 
-    // 1. Rotation
-    if (enableRotation)
-        res.rotationAngleDeg = detectRotation(targetImage);
+    // Tracking: only the window around the predicted position is correlated, with the prior's rotation and scale
+    if (tracking_ && prior.shift.has_value())
+    {
+        auto shift = refineShift(targetImage, *prior.shift, prior.rotationAngleDeg, prior.scalingRatio, &peak);
+        if (shift && peak.psr >= windowMinPsr_)
+        {
+            res.rotationAngleDeg = prior.rotationAngleDeg;
+            res.scalingRatio = prior.scalingRatio;
+            res.dx = shift->x;
+            res.dy = shift->y;
+            res.response = peak.response;
+            res.psr = peak.psr;
+            res.tracked = true;
+            return res;
+        }
+        // Low confidence around the prediction, search the whole frame
+    }
 
-    // 2. Translation – rotate the *original* target first if needed,
-    //    so the translation measurement is clean.
-    cv::Mat tgtForTrans;
-    if (enableRotation && std::abs(res.rotationAngleDeg) > 0.01)
+    // Rotation and scale are measured unless the prior fixes them
+    bool measurePolar = usesPolar() && !prior.fixedRotation;
+    if (prior.fixedRotation)
     {
-        cv::Point2f ctr(targetImage.cols / 2.f, targetImage.rows / 2.f);
-        cv::Mat M = cv::getRotationMatrix2D(ctr, -res.rotationAngleDeg, 1.0);
-        cv::Mat rotated;
-        cv::warpAffine(targetImage, rotated, M, targetImage.size(), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
-        tgtForTrans = preprocess(rotated);
+        res.rotationAngleDeg = prior.rotationAngleDeg;
+        res.scalingRatio = prior.scalingRatio;
     }
-    else
+
+    if (windowed_)
     {
-        tgtForTrans = preprocess(targetImage);
+        // Predict from the downsampled pair when there is a pyramid, then measure at full resolution
+        // only inside the window
+        cv::Point2d predicted(0, 0);
+        if (pyramid_ > 1)
+        {
+            predicted = coarseEstimate(targetImage, measurePolar, res);
+        }
+        else if (measurePolar)
+        {
+            applyRotationScale(res, detectRotationScale(extractWindow(targetImage, cv::Point(0, 0), 0.0, 1.0), polar_));
+        }
+
+        auto shift = refineShift(targetImage, predicted, res.rotationAngleDeg, res.scalingRatio, &peak);
+        if (shift && peak.psr >= windowMinPsr_)
+        {
+            res.dx = shift->x;
+            res.dy = shift->y;
+            res.response = peak.response;
+            res.psr = peak.psr;
+            return res;
+        }
+        // The window estimate did not settle or has no clear peak, fall back to the full frame
     }
 
-    // Pad to matching optimal DFT size
-    int optW = cv::getOptimalDFTSize(std::max(refPrep_.cols, tgtForTrans.cols));
-    int optH = cv::getOptimalDFTSize(std::max(refPrep_.rows, tgtForTrans.rows));
+    // The target is preprocessed once and shared by rotation, translation and the alignment points
+    cv::Mat tgtPrep = preprocess(targetImage);
+    if (preprocessed)
+        *preprocessed = tgtPrep;
 
-    cv::Mat refPad, tgtPad;
-    cv::copyMakeBorder(refPrep_, refPad, 0, optH - refPrep_.rows, 0, optW - refPrep_.cols, cv::BORDER_CONSTANT);
-    cv::copyMakeBorder(tgtForTrans, tgtPad, 0, optH - tgtForTrans.rows, 0, optW - tgtForTrans.cols,
-                       cv::BORDER_CONSTANT);
+    // 1. Rotation and scale, from the same log-polar correlation
+    if (measurePolar && !windowed_)
+        applyRotationScale(res, detectRotationScale(tgtPrep, polar_));
 
-    cv::Mat hann;
-    cv::createHanningWindow(hann, refPad.size(), CV_32F);
-    cv::Point2d shift = cv::phaseCorrelate(refPad, tgtPad, hann);
+    // 2. Translation – rotate and rescale the target first if needed,
+    //    so the translation measurement is clean.
+    cv::Mat tgtForTrans = usesPolar() ? derotate(tgtPrep, res.rotationAngleDeg, res.scalingRatio) : tgtPrep;
+    cv::Point2d shift = correlate(transPlan_, tgtForTrans, &peak);
 
     res.dx = shift.x;
     res.dy = shift.y;
+    res.response = peak.response;
+    res.psr = peak.psr;
     return res;
 }
 
 cv::Mat FFTRegistration::align(const std::string &image_name, const cv::Mat &targetImage) const
 {
-    RegistrationResult res = evaluate(targetImage);
+    cv::Mat prep;
+    RegistrationResult res = evaluate(targetImage, RegistrationPrior{}, &prep);
+    measureLocalShifts(targetImage, res, prep);
+
+    print_result(image_name, res);
+    return warp(targetImage, res);
+}
+
+cv::Mat FFTRegistration::warp(const cv::Mat &targetImage, const RegistrationResult &res) const
+{
+    if (!res.localShifts.empty())
+    {
+        // The global transform applied after the local shift, in one remap: src = Minv * (p + field(p))
+        cv::Point2f ctr(targetImage.cols / 2.f, targetImage.rows / 2.f);
+        cv::Mat M = cv::getRotationMatrix2D(ctr, -res.rotationAngleDeg, res.scalingRatio);
+        M.at<double>(0, 2) -= res.dx;
+        M.at<double>(1, 2) -= res.dy;
+        cv::Mat Minv;
+        cv::invertAffineTransform(M, Minv);
+        const double *m = Minv.ptr<double>();
+
+        cv::Mat field = displacementField(res.localShifts);
+        cv::Mat mapX(refH_, refW_, CV_32F), mapY(refH_, refW_, CV_32F);
+        for (int y = 0; y < refH_; ++y)
+        {
+            const cv::Vec2f *f = field.ptr<cv::Vec2f>(y);
+            float *mx = mapX.ptr<float>(y);
+            float *my = mapY.ptr<float>(y);
+            for (int x = 0; x < refW_; ++x)
+            {
+                double qx = x + f[x][0], qy = y + f[x][1];
+                mx[x] = static_cast<float>(m[0] * qx + m[1] * qy + m[2]);
+                my[x] = static_cast<float>(m[3] * qx + m[4] * qy + m[5]);
+            }
+        }
+
+        cv::Mat aligned;
+        cv::remap(targetImage, aligned, mapX, mapY, interpolation_flag(interpolation_), cv::BORDER_CONSTANT,
+                  cv::Scalar(0));
+        return aligned;
+    }
 
-    std::println("[FFTReg] {} dx={:.2f}  dy={:.2f} rot={:.2f}°  scale={:.2f}", image_name, res.dx, res.dy,
-                 res.rotationAngleDeg, res.scalingRatio);
+    // A pure shift is separable and needs one set of weights per axis. Rotations and scales evaluate does
+    // not correct for are treated as none here as well.
+    if (isTranslation(res.rotationAngleDeg, res.scalingRatio))
+        return translate_image(targetImage, cv::Size(refW_, refH_), res.dx, res.dy, interpolation_);
 
-    // Combined affine: rotate about centre, then translate
+    // Combined affine: rotate and scale about centre, then translate
     cv::Point2f ctr(targetImage.cols / 2.f, targetImage.rows / 2.f);
-    cv::Mat M = cv::getRotationMatrix2D(ctr, -res.rotationAngleDeg, 1.0);
+    cv::Mat M = cv::getRotationMatrix2D(ctr, -res.rotationAngleDeg, res.scalingRatio);
     M.at<double>(0, 2) -= res.dx;
     M.at<double>(1, 2) -= res.dy;
 
     cv::Mat aligned;
-    cv::warpAffine(targetImage, aligned, M, cv::Size(refW_, refH_), cv::INTER_LANCZOS4, cv::BORDER_CONSTANT,
-                   cv::Scalar(0));
+    cv::warpAffine(targetImage, aligned, M, cv::Size(refW_, refH_), interpolation_flag(interpolation_),
+                   cv::BORDER_CONSTANT, cv::Scalar(0));
     return aligned;
 }
+
+CentroidRegistration::CentroidRegistration(const cv::Mat &referenceImage, const RegistrationOptions &options)
+    : refDisk_{findDisk(referenceImage)}, refSize_{referenceImage.size()}, interpolation_{options.interpolation}
+{
+}
+
+// Sum, x- and y-weighted sums of the intensity above the threshold
+template <typename T> static cv::Vec3d disk_moments(const cv::Mat &image, double threshold, int &count)
+{
+    cv::Vec3d moments(0, 0, 0);
+    count = 0;
+    for (int y = 0; y < image.rows; ++y)
+    {
+        const T *row = image.ptr<T>(y);
+        double sum = 0.0, sx = 0.0;
+        for (int x = 0; x < image.cols; ++x)
+        {
+            double w = static_cast<double>(row[x]) - threshold;
+            if (w <= 0.0)
+                continue;
+            sum += w;
+            sx += w * x;
+            ++count;
+        }
+        moments[0] += sum;
+        moments[1] += sx;
+        moments[2] += sum * y;
+    }
+    return moments;
+}
+
+CentroidRegistration::Disk CentroidRegistration::findDisk(const cv::Mat &image)
+{
+    cv::Mat gray = image;
+    if (image.channels() > 1)
+        cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+    if (gray.depth() != CV_8U && gray.depth() != CV_16U && gray.depth() != CV_32F)
+        gray.convertTo(gray, CV_32F);
+
+    double lo, hi;
+    cv::minMaxLoc(gray, &lo, &hi);
+    double threshold = lo + kDiskThreshold * (hi - lo);
+
+    int count = 0;
+    cv::Vec3d m;
+    switch (gray.depth())
+    {
+    case CV_8U:
+        m = disk_moments<uint8_t>(gray, threshold, count);
+        break;
+    case CV_16U:
+        m = disk_moments<uint16_t>(gray, threshold, count);
+        break;
+    default:
+        m = disk_moments<float>(gray, threshold, count);
+        break;
+    }
+
+    Disk disk;
+    if (m[0] <= 0.0)
+        return disk;
+    disk.centroid = cv::Point2d(m[1] / m[0], m[2] / m[0]);
+    disk.coverage = static_cast<double>(count) / gray.total();
+    return disk;
+}
+
+RegistrationResult CentroidRegistration::evaluate(const cv::Mat &targetImage) const
+{
+    RegistrationResult res;
+    Disk disk = findDisk(targetImage);
+    if (disk.coverage <= 0.0 || refDisk_.coverage <= 0.0)
+        return res;
+
+    // dst(x) = src(x + d) puts the target disk onto the reference one
+    res.dx = disk.centroid.x - refDisk_.centroid.x;
+    res.dy = disk.centroid.y - refDisk_.centroid.y;
+    res.response = disk.coverage;
+    return res;
+}
+
+cv::Mat CentroidRegistration::align(const std::string &image_name, const cv::Mat &targetImage) const
+{
+    RegistrationResult res = evaluate(targetImage);
+
+    print_result(image_name, res);
+    return warp(targetImage, res);
+}
+
+cv::Mat CentroidRegistration::warp(const cv::Mat &targetImage, const RegistrationResult &res) const
+{
+    return translate_image(targetImage, refSize_, res.dx, res.dy, interpolation_);
+}
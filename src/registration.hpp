@@ -1,9 +1,15 @@
 #pragma once
 #include "result.hpp"
 #include "commands.hpp"
+#include "fft.hpp"
+#include "warp.hpp"
+#include <memory>
 #include <opencv2/core.hpp>
+#include <optional>
+#include <cstdint>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 struct RegistrationResult
 {
@@ -11,37 +17,293 @@ struct RegistrationResult
     double dy = 0;               // translation Y (pixels)
     double rotationAngleDeg = 0; // rotation (degrees, CCW positive)
     double scalingRatio = 1;     // scale factor
+
+    // Confidence of the measurement
+    double response = 0;    // phase-correlation peak response, as reported by cv::phaseCorrelate
+                            // (centroid engine: fraction of the frame covered by the disk)
+    double psr = 0;         // translation peak-to-sidelobe ratio
+    double rotationPsr = 0; // rotation peak-to-sidelobe ratio (0 without rotation)
+    bool tracked = false;          // measured around a prediction, with the predicted rotation
+    bool rotationMeasured = false; // rotation and scale come from this frame's own log-polar correlation
+
+    // Alignment points: CV_32FC2 grid of local shifts on top of the global registration, NaN where a point was
+    // rejected. Empty without alignment points.
+    cv::Mat localShifts;
+};
+
+/// What is known about a frame's registration before measuring it.
+struct RegistrationPrior
+{
+    std::optional<cv::Point2d> shift; // predicted translation; with tracking only the window around it is searched
+    double rotationAngleDeg = 0;      // rotation and scale used with the predicted shift
+    double scalingRatio = 1;
+    bool fixedRotation = false; // use the rotation and scale above instead of measuring them
+};
+
+enum class RegistrationEngine
+{
+    FFT,      // phase correlation
+    Centroid, // intensity-weighted centroid of the disk, translation only
+    Hybrid,   // centroid shift as the prior of a windowed phase correlation
+};
+
+/// Side of the window used by pyramid refinement, tracking and -roi=auto, and the smallest accepted -roi.
+inline constexpr int kRegistrationWindowSize = 512;
+inline constexpr int kMinRoiSize = 32;
+
+struct RegistrationOptions
+{
+    bool enableRotation = false;
+    bool enableScaling = false;
+    bool useHighpass = true;
+    std::shared_ptr<const FFTBackend> fft; // OpenCV when not set
+
+    // Coarse-to-fine: estimate on a 1/pyramid downsampled pair, then refine at full resolution
+    // inside a window around the prediction. 1 correlates the full frame.
+    int pyramid = 1;
+    double tolerance = 0.05; // largest residual shift (pixels) of the window at the accepted estimate
+
+    // Region of interest the translation is measured in, instead of the full frame.
+    // autoRoi picks the highest-contrast kRegistrationWindowSize window of the preprocessed reference.
+    cv::Rect roi;
+    bool autoRoi = false;
+
+    // Resampling of the aligned frame. Translation-only frames use a separable shift.
+    Interpolation interpolation = Interpolation::Lanczos;
+
+    // Frames below this peak-to-sidelobe ratio (translation or rotation), or shifted further than maxShift pixels,
+    // are not written. 0 disables a check.
+    double minPsr = 0;
+    double maxShift = 0;
+
+    // Tracking: frames with a prior are correlated only in the window around it. Window estimates of any kind
+    // (tracking, pyramid, ROI) below trackingMinPsr fall back to the full search.
+    bool tracking = false;
+    double trackingMinPsr = 6;
+
+    // Angular and radial samples of the polar image used for rotation and scale. 0 uses the spectrum size.
+    int polarAngles = 0;
+    int polarRadii = 0;
+
+    // Measure rotation and scale on every rotationEvery-th frame only, and fit them over capture order
+    int rotationEvery = 1;
+
+    // Sub-pixel peaks from a 1/upsample pixel grid of the inverse DFT around the integer peak, evaluated by
+    // matrix multiplication. 0 uses the 5x5 centroid (translation) and a parabola (rotation).
+    int upsample = 0;
+
+    // Alignment points: apSize pixel tiles on a grid apSize/2 apart, each measuring a local shift that warp turns
+    // into a smooth displacement field. Tiles with less than apContrast of the highest tile contrast in the
+    // reference are skipped. 0 registers globally only.
+    int apSize = 0;
+    double apContrast = 0.2;
+
+    RegistrationEngine engine = RegistrationEngine::FFT;
+
+    // Directory for the prepared reference (preprocessed frame, polar tables and spectrum), keyed by the
+    // reference content and the options it depends on. Empty disables the cache.
+    std::string cacheDir;
 };
 
 class FFTRegistration
 {
   public:
-    FFTRegistration(const cv::Mat &referenceImage, bool enableRotation, bool enableScaling, bool useHighpass);
+    FFTRegistration(const cv::Mat &referenceImage, const RegistrationOptions &options);
     RegistrationResult evaluate(const cv::Mat &targetImage) const;
+    /// When preprocessed is set and the full frame was correlated, it receives the preprocessed frame, which
+    /// measureLocalShifts can then reuse. It is left empty when a window estimate was accepted.
+    RegistrationResult evaluate(const cv::Mat &targetImage, const RegistrationPrior &prior,
+                                cv::Mat *preprocessed = nullptr) const;
+
+    /// Rotation and scale only, measured on the same input evaluate uses.
+    RegistrationResult measureRotationScale(const cv::Mat &targetImage) const;
     cv::Mat align(const std::string &image_name, const cv::Mat &targetImage) const;
 
+    /// Local shifts at the alignment points of a frame whose global registration is in res. The frame is
+    /// preprocessed here unless evaluate already returned it.
+    void measureLocalShifts(const cv::Mat &targetImage, RegistrationResult &res,
+                            const cv::Mat &preprocessed = cv::Mat()) const;
+
+    /// Resample a frame onto the reference grid for a given registration result, including its local shifts.
+    cv::Mat warp(const cv::Mat &targetImage, const RegistrationResult &res) const;
+
+    size_t alignmentPointCount() const
+    {
+        return apCells_.size();
+    }
+
+    /// Whether the prepared reference was loaded from the cache instead of being computed.
+    bool referenceFromCache() const
+    {
+        return fromCache_;
+    }
+
   private:
     bool enableRotation = false;
     bool enableScaling = false;
     bool useHighpass = true;
+    std::shared_ptr<const FFTBackend> fft_;
+    int pyramid_ = 1;
+    double tolerance_ = 0.05;
+    Interpolation interpolation_ = Interpolation::Lanczos;
+    double windowMinPsr_ = 6; // window estimates below this PSR fall back to the full-frame search
+    int upsample_ = 0;
+
+    static constexpr int kMinWindowSize = 64;
+    static constexpr int kWindowMargin = 48; // > 3 sigma of the highpass blur
+    static constexpr int kMaxRefineIterations = 6;
+
+    // Reference side of a phase correlation, prepared once and reused for every target
+    struct CorrelationPlan
+    {
+        cv::Size size;  // padded (optimal DFT) size
+        cv::Mat window; // Hann window over the padded size
+        cv::Mat refFFT; // spectrum of the windowed, padded reference
+    };
+
+    // Reference side of the log-polar rotation and scale correlation
+    struct PolarReference
+    {
+        int size = 0;       // square, optimal DFT size of the magnitude spectrum
+        cv::Mat window;     // Hann window for the magnitude spectrum
+        cv::Mat mapX, mapY; // 0..180° polar remap tables, one row per angle and one column per radius
+        cv::Mat refFFT;     // DFT of the reference's polar magnitude
+    };
+
+    struct CorrelationPeak
+    {
+        double response = 0;
+        double psr = 0;
+    };
+
+    static constexpr int kSidelobeExclusion = 5; // half-size of the box around the peak left out of the sidelobe
+
+    // Per-thread scratch buffers of one correlation size, reused across frames
+    struct CorrelationWorkspace
+    {
+        cv::Mat padded;
+        cv::Mat spectrum;
+        cv::Mat surface;
+        cv::Mat crossPower; // copy of the cross-power spectrum for upsampling, the inverse may overwrite it
+    };
 
     int refW_ = 0, refH_ = 0;
-    cv::Mat refPrep_;     // preprocessed reference (for translation)
-    cv::Mat refPolarFFT_; // DFT of polar magnitude  (for rotation)
-    int polarSize_ = 0;
+    cv::Mat refPrep_; // preprocessed reference (for translation)
+
+    CorrelationPlan transPlan_;  // full-frame translation
+    PolarReference polar_;       // rotation on the coarse pair, the window or the full frame
+    PolarReference windowPolar_; // pyramid: rotation refined on the full-resolution window
+
+    cv::Mat coarsePrep_;         // preprocessed, downsampled reference
+    CorrelationPlan coarsePlan_; // downsampled translation
+
+    bool windowed_ = false;      // translation is measured inside windowRect_ only
+    bool tracking_ = false;      // frames with a prior are measured inside windowRect_
+    cv::Rect windowRect_;        // window position in the reference
+    cv::Mat windowPrep_;         // preprocessed reference window
+    CorrelationPlan windowPlan_; // full-resolution window
+
+    // Alignment points: apGrid_ tiles of apSize_, apStep_ apart from apOrigin_. apCells_ are the grid cells kept,
+    // apRefFFT_ the spectra of their windowed reference tiles.
+    int apSize_ = 0;
+    int apStep_ = 0;
+    cv::Point apOrigin_;
+    cv::Size apGrid_;
+    std::vector<cv::Point> apCells_;
+    std::vector<cv::Mat> apRefFFT_;
+    cv::Mat apWindow_;
+
+    bool fromCache_ = false;
+
+    static constexpr int kMinApSize = 16;
+    static constexpr double kMinApPsr = 5.0;
+    static constexpr int kApBatchSize = 64; // tiles per FFT batch, bounds the scratch memory per thread
+
+    // Per-thread buffers for one batch of alignment-point tiles, reused across batches and frames
+    struct ApWorkspace
+    {
+        std::vector<cv::Mat> tiles;
+        std::vector<cv::Mat> spectra;
+        std::vector<cv::Mat> surfaces;
+        std::vector<cv::Mat> crossPowers;
+    };
+    static ApWorkspace &apWorkspace();
+
+    static constexpr double kDecimatedBlurSigma = 3.0;
 
-    // Precomputed remap tables for the 0..180° polar transform
-    cv::Mat polarMapX_, polarMapY_;
+    // Gray CV_32F in [0, 1], plus a histogram of the pixel values (bin * binScale) from the same pass
+    static cv::Mat toGray32F(const cv::Mat &src, std::vector<uint32_t> &histogram, float &binScale);
+    // Gaussian blur that runs at reduced resolution when sigma is large
+    static void blurLarge(const cv::Mat &src, cv::Mat &dst, double sigma);
+    cv::Mat preprocess(const cv::Mat &src, int downsample = 1) const;
+    static bool isTranslation(double angleDeg, double scale);
+    static cv::Mat derotate(const cv::Mat &prep, double angleDeg, double scale);
+    static cv::Rect selectFeatureWindow(const cv::Mat &prep, cv::Size size);
 
-    static cv::Mat toGray32F(const cv::Mat &src);
-    cv::Mat preprocess(const cv::Mat &src) const;
+    cv::Mat extractWindow(const cv::Mat &image, cv::Point2d offset, double angleDeg, double scale) const;
+    std::optional<cv::Point2d> refineShift(const cv::Mat &targetImage, cv::Point2d predicted, double angleDeg,
+                                           double scale, CorrelationPeak *peak) const;
+
+    cv::Mat computeMagnitudeSpectrum(const cv::Mat &img, const PolarReference &polar) const;
+    static cv::Mat toPolar(const cv::Mat &mag, const PolarReference &polar);
+    // Rotation and, with scaling enabled, scale correction from one log-polar phase correlation
+    struct RotationScale
+    {
+        double angleDeg = 0;
+        double scale = 1;
+        double psr = 0;
+    };
+    RotationScale detectRotationScale(const cv::Mat &tgtPrep, const PolarReference &polar) const;
+    void applyRotationScale(RegistrationResult &res, const RotationScale &rs) const;
+
+    bool usesPolar() const
+    {
+        return enableRotation || enableScaling;
+    }
+
+    CorrelationPlan makePlan(const cv::Mat &ref) const;
+    cv::Point2d correlate(const CorrelationPlan &plan, const cv::Mat &target, CorrelationPeak *peak = nullptr) const;
+    cv::Point2d locatePeak(const cv::Mat &surface, const cv::Mat &crossPower, CorrelationPeak *peak) const;
+    static double peakToSidelobe(const cv::Mat &surface, cv::Point peak);
+    static CorrelationWorkspace &workspace(cv::Size size);
+
+    static void crossPowerSpectrum(const cv::Mat &fftA, cv::Mat &fftB);
+    static void fftShift(cv::Mat &m);
+    void buildPolarRemapTables(PolarReference &polar, int angles, int radii) const;
+    void preparePolar(PolarReference &polar, const cv::Mat &rotRef, int angles, int radii) const;
+    cv::Point2d coarseEstimate(const cv::Mat &targetImage, bool measurePolar, RegistrationResult &res) const;
+
+    void placeAlignmentPoints(int size, double minContrast);
+
+    bool loadReferenceCache(const std::string &path, const std::string &key, int polarMax);
+    void saveReferenceCache(const std::string &path, const std::string &key) const;
+    cv::Mat displacementField(const cv::Mat &localShifts) const;
+};
+
+/// Translation from the intensity-weighted centroid of everything brighter than the background, in two O(n) passes
+/// and without FFTs. Meant for full-disk frames on a dark background; a disk cut by the frame edge biases it.
+class CentroidRegistration
+{
+  public:
+    CentroidRegistration(const cv::Mat &referenceImage, const RegistrationOptions &options);
+    RegistrationResult evaluate(const cv::Mat &targetImage) const;
+    cv::Mat align(const std::string &image_name, const cv::Mat &targetImage) const;
+    cv::Mat warp(const cv::Mat &targetImage, const RegistrationResult &res) const;
+
+  private:
+    // Pixels above kDiskThreshold of the way from the darkest to the brightest pixel belong to the disk
+    static constexpr double kDiskThreshold = 0.2;
 
-    cv::Mat computeMagnitudeSpectrum(const cv::Mat &img, int size) const;
-    cv::Mat toPolar(const cv::Mat &mag, int size) const;
-    double detectRotation(const cv::Mat &targetImg) const;
+    struct Disk
+    {
+        cv::Point2d centroid;
+        double coverage = 0; // fraction of the frame above the threshold
+    };
+    static Disk findDisk(const cv::Mat &image);
 
-    static cv::Mat makeCPS(const cv::Mat &fftA, const cv::Mat &fftB);
-    void buildPolarRemapTables(int size);
+    Disk refDisk_;
+    cv::Size refSize_;
+    Interpolation interpolation_ = Interpolation::Lanczos;
 };
 
 la_result run_registration(std::unordered_map<std::string, std::string> &args, PipelineContext &ctx);
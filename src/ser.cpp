@@ -3,6 +3,7 @@
 
 #include "fitsio.h"
 #include "result.hpp"
+#include <cmath>
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
@@ -11,6 +12,8 @@
 #include <print>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 namespace fs = std::filesystem;
@@ -22,7 +25,75 @@ int32_t read_le_i32(const std::vector<uint8_t> &buffer, size_t offset)
         (static_cast<uint32_t>(buffer[offset + 2]) << 16) | (static_cast<uint32_t>(buffer[offset + 3]) << 24));
 }
 
-la_result SerFile::decode_to_dir(const fs::path &input_path, const fs::path &output_dir)
+struct FrameStats
+{
+    double mean = 0.0;     // fraction of full scale
+    double clipped = 0.0;  // share of pixels at or near full scale
+    double gradient = 0.0; // mean absolute horizontal difference on a sparse grid, relative to the mean level
+};
+
+// Unpacks the little-endian samples and gathers the rejection statistics in the same pass. full_scale is the
+// largest value the sensor can produce, which is below the container maximum for 10-, 12- and 14-bit captures
+template <typename T>
+static FrameStats convert_frame(const std::vector<uint8_t> &frame_buffer, std::vector<T> &image_data, int width,
+                                int height, double full_scale)
+{
+    constexpr int kGradientStep = 4;
+    const T clip_level = static_cast<T>(full_scale * 0.99);
+
+    image_data.resize(static_cast<size_t>(width) * height);
+
+    double sum = 0.0, gradient = 0.0;
+    size_t clipped = 0, gradient_samples = 0;
+
+    for (int y = 0; y < height; ++y)
+    {
+        const uint8_t *src = frame_buffer.data() + static_cast<size_t>(y) * width * sizeof(T);
+        T *dst = image_data.data() + static_cast<size_t>(y) * width;
+        bool sample_row = y % kGradientStep == 0;
+
+        for (int x = 0; x < width; ++x)
+        {
+            T v = 0;
+            for (size_t b = 0; b < sizeof(T); ++b)
+            {
+                v |= static_cast<T>(static_cast<T>(src[x * sizeof(T) + b]) << (8 * b));
+            }
+            dst[x] = v;
+
+            sum += v;
+            clipped += v >= clip_level;
+            if (sample_row && x >= kGradientStep && x % kGradientStep == 0)
+            {
+                gradient += std::abs(static_cast<double>(v) - dst[x - kGradientStep]);
+                ++gradient_samples;
+            }
+        }
+    }
+
+    double n = static_cast<double>(image_data.size());
+    double mean = sum / n;
+
+    FrameStats stats;
+    stats.mean = mean / full_scale;
+    stats.clipped = clipped / n;
+    stats.gradient = (gradient_samples > 0 && mean > 0.0) ? gradient / gradient_samples / mean : 0.0;
+    return stats;
+}
+
+static std::string_view rejection_reason(const FrameStats &stats, const FrameRejection &rejection)
+{
+    if (stats.mean < rejection.min_mean)
+        return "dark";
+    if (stats.clipped > rejection.max_clipped)
+        return "clipped";
+    if (stats.gradient < rejection.min_gradient)
+        return "featureless";
+    return {};
+}
+
+la_result SerFile::decode_to_dir(const fs::path &input_path, const fs::path &output_dir,
+                                 const FrameRejection &rejection)
 {
     std::ifstream file(input_path, std::ios::binary);
     if (!file)
@@ -48,31 +119,29 @@ la_result SerFile::decode_to_dir(const fs::path &input_path, const fs::path &out
     std::println("  - Pixel Depth: {} bits", header.pixel_depth);
     std::println("  - Frame Count: {}", header.frame_count);
 
-    size_t pixels_per_frame = header.width * header.height;
-    size_t bytes_per_pixel = header.pixel_depth / 8;
-    size_t frame_size_bytes = pixels_per_frame * bytes_per_pixel;
-
-    int fits_image_type;
-    switch (header.pixel_depth)
+    if (header.pixel_depth < 1 || header.pixel_depth > 32)
     {
-    case 8:
-        fits_image_type = BYTE_IMG;
-        break;
-    case 16:
-        fits_image_type = USHORT_IMG;
-        break;
-    case 32:
-        fits_image_type = ULONG_IMG;
-        break;
-    default: {
         std::println("Unsupported pixel depth: {}", header.pixel_depth);
         return la_result::Error;
     }
-    }
+
+    // The header gives the significant bits per sample; 9 to 16 bit data is stored in 16-bit words
+    int storage_bits = header.pixel_depth <= 8 ? 8 : header.pixel_depth <= 16 ? 16 : 32;
+    double full_scale = std::ldexp(1.0, header.pixel_depth) - 1.0;
+
+    size_t pixels_per_frame = header.width * header.height;
+    size_t bytes_per_pixel = storage_bits / 8;
+    size_t frame_size_bytes = pixels_per_frame * bytes_per_pixel;
 
     la_result res = la_result::Error;
 
+    int written = 0;
+    std::unordered_map<std::string_view, int> rejected;
+
     std::vector<uint8_t> frame_buffer(frame_size_bytes);
+    std::vector<uint8_t> image_data8;
+    std::vector<uint16_t> image_data16;
+    std::vector<uint32_t> image_data32;
     for (int32_t i = 0; i < header.frame_count; ++i)
     {
         std::println("Processing frame {}/{}", i + 1, header.frame_count);
@@ -84,6 +153,33 @@ la_result SerFile::decode_to_dir(const fs::path &input_path, const fs::path &out
             return la_result::Error;
         }
 
+        FrameStats stats;
+        switch (storage_bits)
+        {
+        case 8:
+            stats = convert_frame(frame_buffer, image_data8, header.width, header.height, full_scale);
+            break;
+        case 16:
+            stats = convert_frame(frame_buffer, image_data16, header.width, header.height, full_scale);
+            break;
+        case 32:
+            stats = convert_frame(frame_buffer, image_data32, header.width, header.height, full_scale);
+            break;
+        }
+
+        // Decide before anything is written, so skipped frames cost no output I/O
+        std::string_view reason = rejection_reason(stats, rejection);
+        if (!reason.empty())
+        {
+            ++rejected[reason];
+            std::println("  rejected frame {} ({}): mean={:.3f} clipped={:.3f} gradient={:.4f}", i, reason, stats.mean,
+                         stats.clipped, stats.gradient);
+            if (!rejection.flag_only)
+            {
+                continue;
+            }
+        }
+
         fs::path output_filename = output_dir / std::format("decoded_{:04d}.fits", i);
 
         std::vector<long> naxes = {header.width, header.height};
@@ -91,34 +187,22 @@ la_result SerFile::decode_to_dir(const fs::path &input_path, const fs::path &out
         std::string create_path = "!" + output_filename.string();
         auto fits_file = FitsFile(create_path, FitsFile::Mode::Create);
 
-        switch (fits_image_type)
+        switch (storage_bits)
         {
-        case 8: {
-            res = fits_file.writeImage(frame_buffer, 2, naxes, 1, pixels_per_frame);
+        case 8:
+            res = fits_file.writeImage(image_data8, 2, naxes, 1, pixels_per_frame);
             break;
-        }
-        case 16: {
-            std::vector<uint16_t> image_data(pixels_per_frame);
-            for (size_t p = 0; p < pixels_per_frame; ++p)
-            {
-                image_data[p] =
-                    static_cast<uint16_t>(frame_buffer[p * 2]) | (static_cast<uint16_t>(frame_buffer[p * 2 + 1]) << 8);
-            }
-            res = fits_file.writeImage(image_data, 2, naxes, 1, pixels_per_frame);
+        case 16:
+            res = fits_file.writeImage(image_data16, 2, naxes, 1, pixels_per_frame);
             break;
-        }
-        case 32: {
-            std::vector<uint32_t> image_data(pixels_per_frame);
-            for (size_t p = 0; p < pixels_per_frame; ++p)
-            {
-                image_data[p] = static_cast<uint32_t>(frame_buffer[p * 4]) |
-                                (static_cast<uint32_t>(frame_buffer[p * 4 + 1]) << 8) |
-                                (static_cast<uint32_t>(frame_buffer[p * 4 + 2]) << 16) |
-                                (static_cast<uint32_t>(frame_buffer[p * 4 + 3]) << 24);
-            }
-            res = fits_file.writeImage(image_data, 2, naxes, 1, pixels_per_frame);
+        case 32:
+            res = fits_file.writeImage(image_data32, 2, naxes, 1, pixels_per_frame);
             break;
         }
+
+        if (!reason.empty())
+        {
+            fits_file.writeKey("REJECT", 1.0, std::string(reason));
         }
 
         std::string bayer_pattern;
@@ -144,8 +228,26 @@ la_result SerFile::decode_to_dir(const fs::path &input_path, const fs::path &out
         {
             res = fits_file.writeKey("BAYERPAT", bayer_pattern);
         }
+        ++written;
+    }
+
+    int rejected_total = 0;
+    for (const auto &[key, count] : rejected)
+    {
+        rejected_total += count;
+    }
+    if (rejected_total > 0)
+    {
+        std::println("\nRejected {} of {} frames ({}): {}", rejected_total, header.frame_count,
+                     rejection.flag_only ? "flagged" : "skipped", rejected);
+    }
+
+    if (written == 0)
+    {
+        std::println("No frames were written.");
+        return la_result::Error;
     }
 
-    std::println("\nConversion complete! {} FITS files written to '{}'.", header.frame_count, output_dir.string());
+    std::println("\nConversion complete! {} FITS files written to '{}'.", written, output_dir.string());
     return res;
 }
@@ -16,8 +16,18 @@ struct SerHeader
     int32_t frame_count;
 };
 
+/// Thresholds for dropping unusable frames while decoding. The defaults keep every frame.
+struct FrameRejection
+{
+    double min_mean = 0.0;     // mean level as a fraction of full scale (blank or clouded frames)
+    double max_clipped = 1.0;  // share of saturated pixels
+    double min_gradient = 0.0; // coarse gradient energy relative to the mean level (featureless frames)
+    bool flag_only = false;    // write rejected frames with a REJECT keyword instead of skipping them
+};
+
 class SerFile
 {
   public:
-    static la_result decode_to_dir(const std::filesystem::path &input_path, const std::filesystem::path &output_dir);
+    static la_result decode_to_dir(const std::filesystem::path &input_path, const std::filesystem::path &output_dir,
+                                   const FrameRejection &rejection = {});
 };
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <cmath>
 #include <cstdint>
 #include <filesystem>
+#include <functional>
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
 #include <print>
@@ -18,12 +19,23 @@
 
 namespace fs = std::filesystem;
 
+static std::vector<cv::Mat> select_local_frames(const std::vector<fs::path> &fits_files, float percentage);
+static cv::Mat expand_tile_selection(const cv::Mat &selection, cv::Size size);
+static float frame_weight(FitsFile &fits_file);
+static cv::Mat stack_in_memory(const std::vector<fs::path> &fits_files, const std::vector<cv::Mat> &selection,
+                               StackMethod method, float sigma, bool use_weights, bool local);
+static cv::Mat stack_in_bands(const std::vector<fs::path> &fits_files, StackMethod method, float sigma,
+                              bool use_weights, size_t memory_bytes);
+
 la_result run_stack(std::unordered_map<std::string, std::string> &args, PipelineContext &ctx)
 {
     fs::path input_dir = args["in"];
     fs::path output_path = args["out"];
     float sigma = std::stof(args["sigma"]);
     bool use_weights = std::stoi(args["weighted"]) != 0;
+    bool local = std::stoi(args["local"]) != 0;
+    float local_percentage = std::stof(args["percent"]);
+    double memory_mb = std::stod(args["memory"]);
 
     std::string method_str = args["method"];
     StackMethod method = StackMethod::SigmaClip;
@@ -51,25 +63,85 @@ la_result run_stack(std::unordered_map<std::string, std::string> &args, Pipeline
     std::println("Stacking {} frames (method={}, sigma={:.2f}, weighted={})...", fits_files.size(), method_str, sigma,
                  use_weights);
 
+    // Local mode picks the best frames per quality-map tile and blends them with per-pixel weights
+    std::vector<cv::Mat> selection;
+    if (local)
+    {
+        selection = select_local_frames(fits_files, local_percentage);
+        if (selection.empty())
+        {
+            return la_result::Error;
+        }
+        std::println("Local selection: best {:.0f}% of frames per {}px tile (weighted mean).", local_percentage,
+                     kRatingTileSize);
+        if (method != StackMethod::Mean)
+        {
+            std::println("Warning: -local=1 always stacks with a weighted mean, -method={} is ignored.", method_str);
+        }
+    }
+
+    // Median and sigma clipping keep every frame; with a memory budget they read one band of rows at a time
+    cv::Mat result;
+    if (memory_mb > 0 && !local && method != StackMethod::Mean)
+    {
+        result = stack_in_bands(fits_files, method, sigma, use_weights, static_cast<size_t>(memory_mb * 1024 * 1024));
+    }
+    else
+    {
+        result = stack_in_memory(fits_files, selection, method, sigma, use_weights, local);
+    }
+
+    if (result.empty())
+    {
+        std::println("Error: Stacking produced an empty result.");
+        return la_result::Error;
+    }
+
+    // Result is already CV_32F from the stacker — write directly as float FITS
+    std::string create_path = "!" + output_path.string();
+    auto out_file = FitsFile(create_path, FitsFile::Mode::Create);
+    out_file.writeCvMat<float>(result);
+
+    std::println("Stacked image written to '{}'.", output_path.string());
+    return la_result::Ok;
+}
+
+static float frame_weight(FitsFile &fits_file)
+{
+    // Prefer the score stored by 'rate', it avoids another pass over the frame
+    if (auto quality = fits_file.readKeyDouble("QUALITY"); quality.has_value())
+    {
+        return static_cast<float>(quality.value());
+    }
+
+    FrameEvaluation evaluator;
+    auto rating = evaluator.rate_image(fits_file);
+    return rating.has_value() ? rating.value() : 1.0f;
+}
+
+static cv::Mat stack_in_memory(const std::vector<fs::path> &fits_files, const std::vector<cv::Mat> &selection,
+                               StackMethod method, float sigma, bool use_weights, bool local)
+{
     FrameStacker stacker(method, sigma, use_weights);
 
     for (int i = 0; i < static_cast<int>(fits_files.size()); ++i)
     {
         auto fits_file = FitsFile(fits_files[i], FitsFile::Mode::ReadOnly);
         auto mat = fits_file.readToCvMat<uint16_t>();
+        float weight = use_weights ? frame_weight(fits_file) : 1.0f;
 
-        float weight = 1.0f;
-        if (use_weights)
+        bool added = false;
+        if (local)
         {
-            FrameEvaluation evaluator;
-            auto rating = evaluator.rate_image(fits_file);
-            if (rating.has_value())
-            {
-                weight = rating.value();
-            }
+            cv::Mat weight_map = expand_tile_selection(selection[i], mat.size()) * (use_weights ? weight : 1.0f);
+            added = stacker.addFrame(mat, weight_map);
+        }
+        else
+        {
+            added = stacker.addFrame(mat, weight);
         }
 
-        if (!stacker.addFrame(mat, weight))
+        if (!added)
         {
             std::println("Warning: '{}' has mismatched dimensions, skipping.", fits_files[i].filename().string());
             continue;
@@ -77,21 +149,147 @@ la_result run_stack(std::unordered_map<std::string, std::string> &args, Pipeline
         std::println("  loaded {}  (weight={:.1f})", fits_files[i].filename().string(), weight);
     }
 
-    cv::Mat result = stacker.stack();
+    return stacker.stack();
+}
 
-    if (result.empty())
+// Rows [row, row + rows) of every channel plane, as CV_16U with the channels interleaved
+static cv::Mat read_band(FitsFile &fits_file, int row, int rows)
+{
+    long cols = fits_file.naxes[0];
+    int channels = fits_file.naxis > 2 ? static_cast<int>(fits_file.naxes[2]) : 1;
+
+    std::vector<cv::Mat> planes(channels);
+    for (int c = 0; c < channels; ++c)
     {
-        std::println("Error: Stacking produced an empty result.");
-        return la_result::Error;
+        auto data = fits_file.readSubset<uint16_t>({1, row + 1, c + 1}, {cols, row + rows, c + 1}, {1, 1, 1});
+        if (data.empty())
+        {
+            return {};
+        }
+        planes[c] = cv::Mat(rows, static_cast<int>(cols), CV_16UC1, data.data()).clone();
     }
 
-    // Result is already CV_32F from the stacker — write directly as float FITS
-    std::string create_path = "!" + output_path.string();
-    auto out_file = FitsFile(create_path, FitsFile::Mode::Create);
-    out_file.writeCvMat<float>(result);
+    cv::Mat band;
+    cv::merge(planes, band);
+    return band;
+}
 
-    std::println("Stacked image written to '{}'.", output_path.string());
-    return la_result::Ok;
+// Out-of-core median and sigma clipping: the frames are read one band of rows at a time, with the band height
+// chosen so that the band of every frame fits the memory budget. Each frame is opened once per band.
+static cv::Mat stack_in_bands(const std::vector<fs::path> &fits_files, StackMethod method, float sigma,
+                              bool use_weights, size_t memory_bytes)
+{
+    // Dimensions and weights come from the headers, frames that do not match the first one are left out
+    std::vector<fs::path> frames;
+    std::vector<float> weights;
+    long width = 0, height = 0, channels = 0;
+    for (const auto &path : fits_files)
+    {
+        auto fits_file = FitsFile(path, FitsFile::Mode::ReadOnly);
+        long c = fits_file.naxis > 2 ? fits_file.naxes[2] : 1;
+        if (frames.empty())
+        {
+            width = fits_file.naxes[0];
+            height = fits_file.naxes[1];
+            channels = c;
+        }
+        else if (fits_file.naxes[0] != width || fits_file.naxes[1] != height || c != channels)
+        {
+            std::println("Warning: '{}' has mismatched dimensions, skipping.", path.filename().string());
+            continue;
+        }
+        frames.push_back(path);
+        weights.push_back(use_weights ? frame_weight(fits_file) : 1.0f);
+    }
+
+    // read_band returns 16-bit samples and FrameStacker keeps them in that form
+    size_t row_bytes = frames.size() * width * channels * sizeof(uint16_t);
+    int band_rows = static_cast<int>(std::clamp<size_t>(memory_bytes / std::max<size_t>(row_bytes, 1), 1, height));
+    std::println("Out-of-core stacking in bands of {} rows ({} bands).", band_rows,
+                 (height + band_rows - 1) / band_rows);
+
+    cv::Mat result(static_cast<int>(height), static_cast<int>(width), CV_MAKETYPE(CV_32F, channels));
+    for (int row = 0; row < height; row += band_rows)
+    {
+        int rows = std::min<int>(band_rows, static_cast<int>(height) - row);
+
+        FrameStacker stacker(method, sigma, use_weights);
+        for (size_t i = 0; i < frames.size(); ++i)
+        {
+            auto fits_file = FitsFile(frames[i], FitsFile::Mode::ReadOnly);
+            cv::Mat band = read_band(fits_file, row, rows);
+            if (band.empty())
+            {
+                return {};
+            }
+            stacker.addFrame(band, weights[i]);
+        }
+
+        stacker.stack().copyTo(result.rowRange(row, row + rows));
+        std::println("  stacked rows {}-{}", row, row + rows - 1);
+    }
+    return result;
+}
+
+static std::vector<cv::Mat> select_local_frames(const std::vector<fs::path> &fits_files, float percentage)
+{
+    int n = static_cast<int>(fits_files.size());
+
+    std::vector<cv::Mat> maps(n);
+    for (int i = 0; i < n; ++i)
+    {
+        auto fits_file = FitsFile(fits_files[i], FitsFile::Mode::ReadOnly);
+        maps[i] = fits_file.readExtension(kQualityMapExtension);
+        if (maps[i].empty() || maps[i].size() != maps[0].size())
+        {
+            std::println("Error: '{}' has no usable quality map, run 'rate' on these frames first.",
+                         fits_files[i].filename().string());
+            return {};
+        }
+        // Unscored (NaN) tiles would have to be ranked against scored ones, so incomplete maps are refused
+        if (!cv::checkRange(maps[i]))
+        {
+            std::println("Error: '{}' has an incomplete quality map, rate these frames again.",
+                         fits_files[i].filename().string());
+            return {};
+        }
+    }
+
+    int keep = std::clamp(static_cast<int>(std::lround(n * (percentage / 100.0f))), 1, n);
+
+    std::vector<cv::Mat> selection(n);
+    for (auto &sel : selection)
+    {
+        sel = cv::Mat::zeros(maps[0].size(), CV_32F);
+    }
+
+    std::vector<std::pair<float, int>> scores(n);
+    for (int ty = 0; ty < maps[0].rows; ++ty)
+    {
+        for (int tx = 0; tx < maps[0].cols; ++tx)
+        {
+            for (int f = 0; f < n; ++f)
+            {
+                scores[f] = {maps[f].at<float>(ty, tx), f};
+            }
+
+            std::nth_element(scores.begin(), scores.begin() + (keep - 1), scores.end(), std::greater<>());
+            for (int k = 0; k < keep; ++k)
+            {
+                selection[scores[k].second].at<float>(ty, tx) = 1.0f;
+            }
+        }
+    }
+    return selection;
+}
+
+static cv::Mat expand_tile_selection(const cv::Mat &selection, cv::Size size)
+{
+    // Bilinear between tile centres, so frame weights fade across tile borders instead of stepping
+    cv::Mat expanded;
+    cv::resize(selection, expanded, cv::Size(selection.cols * kRatingTileSize, selection.rows * kRatingTileSize), 0, 0,
+               cv::INTER_LINEAR);
+    return expanded(cv::Rect(0, 0, size.width, size.height)).clone();
 }
 
 FrameStacker::FrameStacker(StackMethod method, float sigma, bool useWeights)
@@ -101,31 +299,95 @@ FrameStacker::FrameStacker(StackMethod method, float sigma, bool useWeights)
 
 bool FrameStacker::addFrame(const cv::Mat &frame, float weight)
 {
-    cv::Mat f32;
-    if (frame.depth() != CV_32F)
+    if (method_ == StackMethod::Mean)
     {
-        frame.convertTo(f32, CV_32F);
-    }
-    else
-    {
-        f32 = frame.clone();
+        return accumulateMean(frame, useWeights_ ? weight : 1.0f);
     }
 
     // Validate dimensions match the first frame
     if (!frames_.empty())
     {
         const auto &ref = frames_[0];
-        if (f32.rows != ref.rows || f32.cols != ref.cols || f32.channels() != ref.channels())
+        if (frame.rows != ref.rows || frame.cols != ref.cols || frame.channels() != ref.channels())
             return false;
     }
 
-    frames_.push_back(std::move(f32));
+    // Integer frames keep 16 bits per sample, everything else is promoted to float. Both are exact, so the
+    // kernels see the same values as from an all-float copy at half the memory.
+    bool integral = frame.depth() == CV_8U || frame.depth() == CV_16U;
+    integral_ = integral_ && integral;
+
+    cv::Mat stored;
+    if (frame.depth() == CV_16U || frame.depth() == CV_32F)
+    {
+        stored = frame.clone();
+    }
+    else
+    {
+        frame.convertTo(stored, integral ? CV_16U : CV_32F);
+    }
+
+    frames_.push_back(std::move(stored));
     weights_.push_back(weight);
     return true;
 }
 
+bool FrameStacker::addFrame(const cv::Mat &frame, const cv::Mat &weightMap)
+{
+    int channels = frame.channels();
+
+    if (weightedSum_.empty())
+    {
+        weightedSum_ = cv::Mat::zeros(frame.size(), CV_MAKETYPE(CV_64F, channels));
+        weightTotal_ = cv::Mat::zeros(frame.size(), CV_64F);
+    }
+    else if (frame.size() != weightedSum_.size() || channels != weightedSum_.channels())
+    {
+        return false;
+    }
+
+    if (weightMap.size() != frame.size() || weightMap.type() != CV_32F)
+    {
+        return false;
+    }
+
+    cv::Mat f32;
+    frame.convertTo(f32, CV_32F);
+
+#ifdef LUNALIGN_USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int r = 0; r < f32.rows; ++r)
+    {
+        const float *src = f32.ptr<float>(r);
+        const float *w = weightMap.ptr<float>(r);
+        double *acc = weightedSum_.ptr<double>(r);
+        double *total = weightTotal_.ptr<double>(r);
+
+        for (int c = 0; c < f32.cols; ++c)
+        {
+            total[c] += w[c];
+            for (int ch = 0; ch < channels; ++ch)
+            {
+                acc[c * channels + ch] += static_cast<double>(w[c]) * src[c * channels + ch];
+            }
+        }
+    }
+    return true;
+}
+
 cv::Mat FrameStacker::stack() const
 {
+    if (!weightedSum_.empty())
+    {
+        return stackWeightMaps();
+    }
+
+    if (method_ == StackMethod::Mean)
+    {
+        return stackMean();
+    }
+
     if (frames_.empty())
     {
         return {};
@@ -133,169 +395,421 @@ cv::Mat FrameStacker::stack() const
 
     switch (method_)
     {
-    case StackMethod::Mean:
-        return stackMean();
     case StackMethod::Median:
         return stackMedian();
     case StackMethod::SigmaClip:
         return stackSigmaClip();
+    default:
+        break;
     }
     return {};
 }
 
-cv::Mat FrameStacker::stackMean() const
+// acc += w * frame, converting each element as it is read so that no frame-sized temporary is needed
+template <typename T> static void accumulate_weighted(const cv::Mat &frame, double w, cv::Mat &acc)
 {
-    int n = static_cast<int>(frames_.size());
-    cv::Mat acc = cv::Mat::zeros(frames_[0].size(), frames_[0].type());
-    float total_weight = 0.f;
+    const int n = frame.cols * frame.channels();
 
-    for (int i = 0; i < n; ++i)
+#ifdef LUNALIGN_USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int r = 0; r < frame.rows; ++r)
+    {
+        const T *src = frame.ptr<T>(r);
+        double *dst = acc.ptr<double>(r);
+        for (int e = 0; e < n; ++e)
+        {
+            dst[e] += w * static_cast<double>(src[e]);
+        }
+    }
+}
+
+bool FrameStacker::accumulateMean(const cv::Mat &frame, float weight)
+{
+    if (meanSum_.empty())
+    {
+        meanSum_ = cv::Mat::zeros(frame.size(), CV_MAKETYPE(CV_64F, frame.channels()));
+    }
+    else if (frame.size() != meanSum_.size() || frame.channels() != meanSum_.channels())
+    {
+        return false;
+    }
+
+    switch (frame.depth())
+    {
+    case CV_8U:
+        accumulate_weighted<uint8_t>(frame, weight, meanSum_);
+        break;
+    case CV_16U:
+        accumulate_weighted<uint16_t>(frame, weight, meanSum_);
+        break;
+    case CV_32F:
+        accumulate_weighted<float>(frame, weight, meanSum_);
+        break;
+    default:
     {
-        float w = useWeights_ ? weights_[i] : 1.0f;
-        acc += frames_[i] * w;
-        total_weight += w;
+        cv::Mat f32;
+        frame.convertTo(f32, CV_32F);
+        accumulate_weighted<float>(f32, weight, meanSum_);
+        break;
+    }
     }
 
-    acc /= total_weight;
-    return acc;
+    meanWeight_ += weight;
+    return true;
 }
 
-cv::Mat FrameStacker::stackMedian() const
+cv::Mat FrameStacker::stackMean() const
 {
-    int n = static_cast<int>(frames_.size());
-    int rows = frames_[0].rows;
-    int cols = frames_[0].cols;
-    int channels = frames_[0].channels();
+    if (meanSum_.empty() || meanWeight_ <= 0.0)
+    {
+        return {};
+    }
 
-    cv::Mat result(rows, cols, frames_[0].type());
+    cv::Mat result;
+    meanSum_.convertTo(result, CV_MAKETYPE(CV_32F, meanSum_.channels()), 1.0 / meanWeight_);
+    return result;
+}
+
+cv::Mat FrameStacker::stackWeightMaps() const
+{
+    int channels = weightedSum_.channels();
+    cv::Mat result(weightedSum_.size(), CV_MAKETYPE(CV_32F, channels));
 
 #ifdef LUNALIGN_USE_OPENMP
-#pragma omp parallel
+#pragma omp parallel for schedule(static)
 #endif
+    for (int r = 0; r < result.rows; ++r)
     {
-        std::vector<float> buf(n);
+        const double *acc = weightedSum_.ptr<double>(r);
+        const double *total = weightTotal_.ptr<double>(r);
+        float *dst = result.ptr<float>(r);
 
-#ifdef LUNALIGN_USE_OPENMP
-#pragma omp for schedule(dynamic)
-#endif
-        for (int r = 0; r < rows; ++r)
+        for (int c = 0; c < result.cols; ++c)
         {
-            for (int c = 0; c < cols * channels; ++c)
+            for (int ch = 0; ch < channels; ++ch)
             {
-                for (int f = 0; f < n; ++f)
-                    buf[f] = frames_[f].ptr<float>(r)[c];
-
-                std::nth_element(buf.begin(), buf.begin() + n / 2, buf.end());
-                result.ptr<float>(r)[c] = buf[n / 2];
+                dst[c * channels + ch] = total[c] > 0.0 ? static_cast<float>(acc[c * channels + ch] / total[c]) : 0.f;
             }
         }
     }
     return result;
 }
 
-cv::Mat FrameStacker::stackSigmaClip() const
-{
-    int n = static_cast<int>(frames_.size());
-    int rows = frames_[0].rows;
-    int cols = frames_[0].cols;
-    int channels = frames_[0].channels();
+// Pixels handled together by the median and sigma-clipping kernels. The frames of a block are gathered frame-major,
+// so every frame contributes one contiguous run of kStackLanes values and every per-frame loop runs across the lanes.
+static constexpr int kStackLanes = 16;
 
-    cv::Mat result(rows, cols, frames_[0].type());
+// Larger medians select by radix on integral data instead of running a sorting network
+static constexpr int kMaxNetworkFrames = 64;
 
-    constexpr int kClipPasses = 2;
+// Calls kernel(block, out) for every kStackLanes-wide block of every row. The block holds the values of all
+// frames as T, frame-major, and may be overwritten. In the last block of a row the lanes past the row end keep
+// whatever an earlier block left there and their results are dropped. T = uint16_t gathers CV_16U frames without
+// conversion and needs every frame to be CV_16U. Each thread works on its own copy of the kernel, so kernels can
+// carry scratch buffers.
+template <typename T, typename Kernel>
+static void for_each_block(const std::vector<cv::Mat> &frames, cv::Mat &result, const Kernel &kernel)
+{
+    constexpr int L = kStackLanes;
+    const int n = static_cast<int>(frames.size());
+    const int rowLen = result.cols * result.channels();
 
 #ifdef LUNALIGN_USE_OPENMP
 #pragma omp parallel
 #endif
     {
-        std::vector<float> vals(n);
-        std::vector<float> w(n);
-        std::vector<bool> keep(n);
+        Kernel local = kernel;
+        std::vector<T> vals(static_cast<size_t>(n) * L, T{});
+        float out[L];
 
 #ifdef LUNALIGN_USE_OPENMP
 #pragma omp for schedule(dynamic)
 #endif
-        for (int r = 0; r < rows; ++r)
+        for (int r = 0; r < result.rows; ++r)
         {
-            for (int c = 0; c < cols * channels; ++c)
+            float *dst = result.ptr<float>(r);
+            for (int c0 = 0; c0 < rowLen; c0 += L)
             {
+                const int lanes = std::min(L, rowLen - c0);
                 for (int f = 0; f < n; ++f)
                 {
-                    vals[f] = frames_[f].ptr<float>(r)[c];
-                    w[f] = useWeights_ ? weights_[f] : 1.0f;
-                }
-
-                std::fill(keep.begin(), keep.end(), true);
-                int kept = n;
-
-                for (int pass = 0; pass < kClipPasses; ++pass)
-                {
-                    if (kept < 3)
-                    {
-                        break;
-                    }
-
-                    // Weighted mean
-                    float sum_w = 0.f, sum_wv = 0.f;
-                    for (int f = 0; f < n; ++f)
+                    T *block = vals.data() + f * L;
+                    if (frames[f].depth() == CV_16U)
                     {
-                        if (!keep[f])
+                        const uint16_t *src = frames[f].ptr<uint16_t>(r) + c0;
+                        for (int l = 0; l < lanes; ++l)
                         {
-                            continue;
+                            block[l] = static_cast<T>(src[l]);
                         }
-                        sum_wv += w[f] * vals[f];
-                        sum_w += w[f];
                     }
-                    if (sum_w == 0.f)
+                    else
                     {
-                        break;
-                    }
-                    float mean = sum_wv / sum_w;
-
-                    // Standard deviation (unweighted for robust clipping)
-                    float sum_sq = 0.f;
-                    for (int f = 0; f < n; ++f)
-                    {
-                        if (!keep[f])
+                        const float *src = frames[f].ptr<float>(r) + c0;
+                        for (int l = 0; l < lanes; ++l)
                         {
-                            continue;
+                            block[l] = static_cast<T>(src[l]);
                         }
-                        float diff = vals[f] - mean;
-                        sum_sq += diff * diff;
                     }
-                    float stddev = std::sqrt(sum_sq / static_cast<float>(kept));
+                }
 
-                    if (stddev < 1e-10f)
-                    {
-                        break; // all values effectively identical
-                    }
+                local(vals.data(), out);
+                std::copy_n(out, lanes, dst + c0);
+            }
+        }
+    }
+}
 
-                    float lo = mean - sigma_ * stddev;
-                    float hi = mean + sigma_ * stddev;
-                    for (int f = 0; f < n; ++f)
+// Comparators of Batcher's odd-even merge sort for the next power of two, keeping only those that can affect
+// sorted position `rank`. Comparators with a position >= n would only ever meet the +inf padding and are dropped.
+static std::vector<std::pair<int, int>> selection_network(int n, int rank)
+{
+    int size = 1;
+    while (size < n)
+    {
+        size <<= 1;
+    }
+
+    std::vector<std::pair<int, int>> network;
+    for (int p = 1; p < size; p <<= 1)
+    {
+        for (int k = p; k >= 1; k >>= 1)
+        {
+            for (int j = k % p; j + k < size; j += 2 * k)
+            {
+                for (int i = 0; i < std::min(k, size - j - k); ++i)
+                {
+                    if ((i + j) / (2 * p) == (i + j + k) / (2 * p) && i + j + k < n)
                     {
-                        if (keep[f] && (vals[f] < lo || vals[f] > hi))
-                        {
-                            keep[f] = false;
-                            --kept;
-                        }
+                        network.emplace_back(i + j, i + j + k);
                     }
                 }
+            }
+        }
+    }
+
+    // Walk back from the output position, keeping comparators that feed it
+    std::vector<bool> needed(n, false);
+    needed[rank] = true;
+    std::vector<std::pair<int, int>> pruned;
+    for (auto it = network.rbegin(); it != network.rend(); ++it)
+    {
+        if (needed[it->first] || needed[it->second])
+        {
+            needed[it->first] = needed[it->second] = true;
+            pruned.push_back(*it);
+        }
+    }
+    std::reverse(pruned.begin(), pruned.end());
+    return pruned;
+}
+
+// Median of every lane by a sorting network; each comparator is a min/max across the lanes of two frame rows
+static void median_network_block(float *vals, const std::vector<std::pair<int, int>> &network, int rank, float *out)
+{
+    constexpr int L = kStackLanes;
+    for (const auto &[a, b] : network)
+    {
+        float *x = vals + a * L;
+        float *y = vals + b * L;
+        for (int l = 0; l < L; ++l)
+        {
+            float lo = std::min(x[l], y[l]);
+            float hi = std::max(x[l], y[l]);
+            x[l] = lo;
+            y[l] = hi;
+        }
+    }
+    std::copy_n(vals + rank * L, L, out);
+}
+
+// Median of every lane by two radix passes over the stored 16-bit values: the high byte histogram finds the bucket
+// holding the rank, the low byte histogram of that bucket the value
+static void median_radix_block(const uint16_t *vals, int n, int rank, float *out)
+{
+    constexpr int L = kStackLanes;
+    uint32_t hist[256];
+    for (int l = 0; l < L; ++l)
+    {
+        std::fill(hist, hist + 256, 0u);
+        for (int f = 0; f < n; ++f)
+        {
+            ++hist[vals[f * L + l] >> 8];
+        }
+        int high = 0, below = 0;
+        while (below + static_cast<int>(hist[high]) <= rank)
+        {
+            below += hist[high++];
+        }
+
+        std::fill(hist, hist + 256, 0u);
+        for (int f = 0; f < n; ++f)
+        {
+            uint16_t v = vals[f * L + l];
+            if ((v >> 8) == high)
+            {
+                ++hist[v & 0xff];
+            }
+        }
+        int low = 0;
+        while (below + static_cast<int>(hist[low]) <= rank)
+        {
+            below += hist[low++];
+        }
+        out[l] = static_cast<float>((high << 8) | low);
+    }
+}
+
+// Sigma clipping of kStackLanes pixels at once. vals holds n rows of kStackLanes values, keep is scratch of the same
+// size. Each lane follows the scalar algorithm exactly (same summation order, same early exits), its keep flags
+// and exit state live in lane-wide arrays instead of branches.
+template <bool Weighted, int Passes>
+static void sigma_clip_block(const float *vals, const float *weights, int n, float sigma, float *keep, float *out)
+{
+    constexpr int L = kStackLanes;
+    float kept[L], active[L], lo[L], hi[L], sumW[L], sumWV[L], sumSq[L], mean[L];
+
+    std::fill(keep, keep + n * L, 1.f);
+    std::fill(kept, kept + L, static_cast<float>(n));
+    std::fill(active, active + L, 1.f);
 
-                // Final weighted mean of surviving pixels
-                float sum_w = 0.f, sum_wv = 0.f;
+    for (int pass = 0; pass < Passes; ++pass)
+    {
+        std::fill(sumW, sumW + L, 0.f);
+        std::fill(sumWV, sumWV + L, 0.f);
+        std::fill(sumSq, sumSq + L, 0.f);
+
+        // Weighted mean
+        for (int f = 0; f < n; ++f)
+        {
+            const float w = Weighted ? weights[f] : 1.f;
+            const float *v = vals + f * L;
+            const float *k = keep + f * L;
+            for (int l = 0; l < L; ++l)
+            {
+                sumWV[l] += k[l] * (w * v[l]);
+                sumW[l] += k[l] * w;
+            }
+        }
+        for (int l = 0; l < L; ++l)
+        {
+            active[l] = (active[l] > 0.f && kept[l] >= 3.f && sumW[l] != 0.f) ? 1.f : 0.f;
+            mean[l] = active[l] > 0.f ? sumWV[l] / sumW[l] : 0.f;
+        }
+
+        // Standard deviation (unweighted for robust clipping)
+        for (int f = 0; f < n; ++f)
+        {
+            const float *v = vals + f * L;
+            const float *k = keep + f * L;
+            for (int l = 0; l < L; ++l)
+            {
+                float diff = v[l] - mean[l];
+                sumSq[l] += k[l] * (diff * diff);
+            }
+        }
+
+        bool any = false;
+        for (int l = 0; l < L; ++l)
+        {
+            float stddev = active[l] > 0.f ? std::sqrt(sumSq[l] / kept[l]) : 0.f;
+            active[l] = (active[l] > 0.f && stddev >= 1e-10f) ? 1.f : 0.f; // all values effectively identical
+            lo[l] = mean[l] - sigma * stddev;
+            hi[l] = mean[l] + sigma * stddev;
+            any |= active[l] > 0.f;
+        }
+        if (!any)
+        {
+            break;
+        }
+
+        for (int f = 0; f < n; ++f)
+        {
+            const float *v = vals + f * L;
+            float *k = keep + f * L;
+            for (int l = 0; l < L; ++l)
+            {
+                float drop = (v[l] < lo[l] || v[l] > hi[l]) ? k[l] * active[l] : 0.f;
+                k[l] -= drop;
+                kept[l] -= drop;
+            }
+        }
+    }
+
+    // Final weighted mean of surviving pixels
+    std::fill(sumW, sumW + L, 0.f);
+    std::fill(sumWV, sumWV + L, 0.f);
+    for (int f = 0; f < n; ++f)
+    {
+        const float w = Weighted ? weights[f] : 1.f;
+        const float *v = vals + f * L;
+        const float *k = keep + f * L;
+        for (int l = 0; l < L; ++l)
+        {
+            sumWV[l] += k[l] * (w * v[l]);
+            sumW[l] += k[l] * w;
+        }
+    }
+    for (int l = 0; l < L; ++l)
+    {
+        out[l] = sumW[l] > 0.f ? sumWV[l] / sumW[l] : 0.f;
+    }
+}
+
+cv::Mat FrameStacker::stackMedian() const
+{
+    const int n = static_cast<int>(frames_.size());
+    const int rank = n / 2; // upper median for even counts
+    cv::Mat result(frames_[0].rows, frames_[0].cols, CV_MAKETYPE(CV_32F, frames_[0].channels()));
+
+    if (n <= kMaxNetworkFrames)
+    {
+        auto network = selection_network(n, rank);
+        for_each_block<float>(frames_, result, [&network, rank](float *vals, float *out) {
+            median_network_block(vals, network, rank, out);
+        });
+    }
+    else if (integral_)
+    {
+        for_each_block<uint16_t>(frames_, result,
+                                 [n, rank](uint16_t *vals, float *out) { median_radix_block(vals, n, rank, out); });
+    }
+    else
+    {
+        for_each_block<float>(frames_, result, [buf = std::vector<float>(n), n, rank](float *vals, float *out) mutable {
+            for (int l = 0; l < kStackLanes; ++l)
+            {
                 for (int f = 0; f < n; ++f)
                 {
-                    if (!keep[f])
-                    {
-                        continue;
-                    }
-                    sum_wv += w[f] * vals[f];
-                    sum_w += w[f];
+                    buf[f] = vals[f * kStackLanes + l];
                 }
-                result.ptr<float>(r)[c] = (sum_w > 0.f) ? sum_wv / sum_w : 0.f;
+                std::nth_element(buf.begin(), buf.begin() + rank, buf.end());
+                out[l] = buf[rank];
             }
-        }
+        });
     }
     return result;
-}
\ No newline at end of file
+}
+
+cv::Mat FrameStacker::stackSigmaClip() const
+{
+    cv::Mat result(frames_[0].rows, frames_[0].cols, CV_MAKETYPE(CV_32F, frames_[0].channels()));
+
+    constexpr int kClipPasses = 2;
+    const int n = static_cast<int>(frames_.size());
+    std::vector<float> keep(static_cast<size_t>(n) * kStackLanes);
+
+    if (useWeights_)
+    {
+        for_each_block<float>(frames_, result, [this, n, keep](float *vals, float *out) mutable {
+            sigma_clip_block<true, kClipPasses>(vals, weights_.data(), n, sigma_, keep.data(), out);
+        });
+    }
+    else
+    {
+        for_each_block<float>(frames_, result, [this, n, keep](float *vals, float *out) mutable {
+            sigma_clip_block<false, kClipPasses>(vals, weights_.data(), n, sigma_, keep.data(), out);
+        });
+    }
+    return result;
+}
@@ -20,9 +20,14 @@ class FrameStacker
     FrameStacker(StackMethod method, float sigma, bool useWeights);
 
     /// Add a frame with an optional quality weight (default 1.0).
-    /// Returns false if the frame dimensions don't match previous frames.
+    /// Returns false if the frame dimensions don't match previous frames. Mean stacking accumulates the frame
+    /// right away; median and sigma clipping keep it until stack().
     bool addFrame(const cv::Mat &frame, float weight = 1.0f);
 
+    /// Add a frame with a per-pixel weight map (CV_32F, same size as the frame).
+    /// Frames are accumulated immediately and combined with a weighted mean, whatever the stacking method.
+    bool addFrame(const cv::Mat &frame, const cv::Mat &weightMap);
+
     /// Produce the final stacked image (CV_32F).
     cv::Mat stack() const;
 
@@ -31,12 +36,21 @@ class FrameStacker
     float sigma_;
     bool useWeights_;
 
-    std::vector<cv::Mat> frames_; // stored as CV_32F (per channel)
+    std::vector<cv::Mat> frames_; // CV_16U for 8- and 16-bit input, CV_32F otherwise; converted as the kernels read
     std::vector<float> weights_;
+    bool integral_ = true; // every frame is stored as CV_16U
+
+    cv::Mat meanSum_; // CV_64F running weighted sum for mean stacking
+    double meanWeight_ = 0.0;
+
+    cv::Mat weightedSum_; // CV_64F accumulators for per-pixel weighted frames
+    cv::Mat weightTotal_;
 
+    bool accumulateMean(const cv::Mat &frame, float weight);
     cv::Mat stackMean() const;
     cv::Mat stackMedian() const;
     cv::Mat stackSigmaClip() const;
+    cv::Mat stackWeightMaps() const;
 };
 
 la_result run_stack(std::unordered_map<std::string, std::string> &args, PipelineContext &ctx);
\ No newline at end of file
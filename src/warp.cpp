@@ -0,0 +1,188 @@
+#include "warp.hpp"
+#include <algorithm>
+#include <cmath>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <vector>
+
+// Weights of a 1-D shift. Output sample i reads source samples i + first .. i + first + weights.size() - 1.
+struct ShiftKernel
+{
+    int first = 0;
+    std::vector<float> weights;
+};
+
+static ShiftKernel make_kernel(double shift, Interpolation interp);
+template <typename T> static void translate(const cv::Mat &src, cv::Mat &dst, const ShiftKernel &kx,
+                                            const ShiftKernel &ky);
+
+std::optional<Interpolation> parse_interpolation(const std::string &name)
+{
+    if (name == "none")
+        return Interpolation::None;
+    if (name == "cubic")
+        return Interpolation::Cubic;
+    if (name == "lanczos")
+        return Interpolation::Lanczos;
+    return std::nullopt;
+}
+
+int interpolation_flag(Interpolation interp)
+{
+    switch (interp)
+    {
+    case Interpolation::None:
+        return cv::INTER_NEAREST;
+    case Interpolation::Cubic:
+        return cv::INTER_CUBIC;
+    case Interpolation::Lanczos:
+    default:
+        return cv::INTER_LANCZOS4;
+    }
+}
+
+static ShiftKernel make_kernel(double shift, Interpolation interp)
+{
+    double base = std::floor(shift);
+    double frac = shift - base;
+
+    if (interp == Interpolation::None)
+        return {static_cast<int>(std::lround(shift)), {1.0f}};
+    if (frac == 0.0)
+        return {static_cast<int>(base), {1.0f}};
+
+    // Taps on either side of the sample position, at source offsets base - radius + 1 .. base + radius
+    int radius = interp == Interpolation::Cubic ? 2 : 3;
+    ShiftKernel kernel{static_cast<int>(base) - radius + 1, std::vector<float>(2 * radius)};
+
+    double sum = 0.0;
+    for (int i = 0; i < 2 * radius; ++i)
+    {
+        double x = std::abs(i - radius + 1 - frac);
+        double w;
+        if (interp == Interpolation::Cubic)
+        {
+            // Keys kernel with a = -0.75, as used by cv::INTER_CUBIC
+            constexpr double a = -0.75;
+            w = x < 1.0 ? ((a + 2) * x - (a + 3)) * x * x + 1 : ((a * x - 5 * a) * x + 8 * a) * x - 4 * a;
+        }
+        else
+        {
+            double px = CV_PI * x;
+            w = std::sin(px) * std::sin(px / radius) * radius / (px * px);
+        }
+        kernel.weights[i] = static_cast<float>(w);
+        sum += w;
+    }
+
+    for (float &w : kernel.weights)
+        w = static_cast<float>(w / sum);
+    return kernel;
+}
+
+// Horizontal pass into a float buffer holding the source rows the vertical pass needs, then the vertical pass.
+// Every tap is a shifted multiply-add over a whole contiguous row, which the compiler vectorises.
+template <typename T>
+static void translate(const cv::Mat &src, cv::Mat &dst, const ShiftKernel &kx, const ShiftKernel &ky)
+{
+    const int ch = src.channels();
+    const int outW = dst.cols, outH = dst.rows;
+    const int tapsX = static_cast<int>(kx.weights.size());
+    const int tapsY = static_cast<int>(ky.weights.size());
+
+    int rowLo = std::max(ky.first, 0);
+    int rowHi = std::min(outH - 1 + ky.first + tapsY, src.rows);
+
+    dst.setTo(0);
+    if (rowLo >= rowHi)
+        return;
+
+    cv::Mat tmp = cv::Mat::zeros(rowHi - rowLo, outW * ch, CV_32F);
+    for (int r = rowLo; r < rowHi; ++r)
+    {
+        const T *in = src.ptr<T>(r);
+        float *out = tmp.ptr<float>(r - rowLo);
+        for (int i = 0; i < tapsX; ++i)
+        {
+            int offset = kx.first + i;
+            int x0 = std::max(0, -offset), x1 = std::min(outW, src.cols - offset);
+            if (x0 >= x1)
+                continue;
+
+            const float w = kx.weights[i];
+            const T *s = in + (x0 + offset) * ch;
+            float *d = out + x0 * ch;
+            const int n = (x1 - x0) * ch;
+            for (int e = 0; e < n; ++e)
+                d[e] += w * static_cast<float>(s[e]);
+        }
+    }
+
+    std::vector<float> acc(outW * ch);
+    for (int y = 0; y < outH; ++y)
+    {
+        std::fill(acc.begin(), acc.end(), 0.f);
+        bool any = false;
+        for (int j = 0; j < tapsY; ++j)
+        {
+            int r = y + ky.first + j;
+            if (r < rowLo || r >= rowHi)
+                continue;
+
+            const float w = ky.weights[j];
+            const float *s = tmp.ptr<float>(r - rowLo);
+            for (int e = 0; e < outW * ch; ++e)
+                acc[e] += w * s[e];
+            any = true;
+        }
+        if (!any)
+            continue;
+
+        T *d = dst.ptr<T>(y);
+        for (int e = 0; e < outW * ch; ++e)
+            d[e] = cv::saturate_cast<T>(acc[e]);
+    }
+}
+
+// Whole-pixel shift: the overlapping rectangle is copied, the rest stays zero
+static void copy_shifted(const cv::Mat &src, cv::Mat &dst, int dx, int dy)
+{
+    dst.setTo(0);
+    cv::Rect from = cv::Rect(dx, dy, dst.cols, dst.rows) & cv::Rect(0, 0, src.cols, src.rows);
+    if (from.empty())
+        return;
+    src(from).copyTo(dst(cv::Rect(from.x - dx, from.y - dy, from.width, from.height)));
+}
+
+cv::Mat translate_image(const cv::Mat &src, cv::Size size, double dx, double dy, Interpolation interp)
+{
+    cv::Mat dst(size, src.type());
+
+    ShiftKernel kx = make_kernel(dx, interp);
+    ShiftKernel ky = make_kernel(dy, interp);
+    if (kx.weights.size() == 1 && ky.weights.size() == 1)
+    {
+        copy_shifted(src, dst, kx.first, ky.first);
+        return dst;
+    }
+
+    switch (src.depth())
+    {
+    case CV_8U:
+        translate<uint8_t>(src, dst, kx, ky);
+        break;
+    case CV_16U:
+        translate<uint16_t>(src, dst, kx, ky);
+        break;
+    case CV_32F:
+        translate<float>(src, dst, kx, ky);
+        break;
+    default:
+    {
+        cv::Mat M = (cv::Mat_<double>(2, 3) << 1, 0, -dx, 0, 1, -dy);
+        cv::warpAffine(src, dst, M, size, interpolation_flag(interp), cv::BORDER_CONSTANT, cv::Scalar(0));
+        break;
+    }
+    }
+    return dst;
+}
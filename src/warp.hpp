@@ -0,0 +1,21 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <optional>
+#include <string>
+
+enum class Interpolation
+{
+    None,    // whole-pixel shifts, applied as copies
+    Cubic,   // 4-tap bicubic
+    Lanczos, // 6-tap Lanczos3 for translations, Lanczos4 for general warps
+};
+
+std::optional<Interpolation> parse_interpolation(const std::string &name);
+
+/// OpenCV interpolation flag for general (rotating) warps.
+int interpolation_flag(Interpolation interp);
+
+/// Resample src so that dst(x, y) = src(x + dx, y + dy), with zeros outside the source.
+/// Separable: each axis uses one set of kernel weights for the whole frame. CV_8U, CV_16U and CV_32F with any
+/// channel count.
+cv::Mat translate_image(const cv::Mat &src, cv::Size size, double dx, double dy, Interpolation interp);